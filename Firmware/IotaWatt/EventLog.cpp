@@ -0,0 +1,86 @@
+#include "IotaWatt.h"
+
+EventLog::EventLog(const String& path, size_t recordSize, uint32_t slots, uint8_t* queue, uint32_t queueSize)
+  :_path(path)
+  ,_recordSize(recordSize)
+  ,_slots(slots)
+  ,_queue(queue)
+  ,_queueSize(queueSize)
+  {}
+
+uint8_t* EventLog::queueSlot(){
+  if(_queueIn - _queueOut >= _queueSize){
+    _dropped++;
+    return nullptr;
+  }
+  uint8_t* record = _queue + (_queueIn % _queueSize) * _recordSize;
+  memset(record, 0, _recordSize);
+  return record;
+}
+
+void EventLog::queued(){
+  _queueIn++;
+}
+
+/***************************************************************************************************
+ *  service() - Write queued events to the log, calling written with each.
+ *  The first time, find where the log left off, EVENTLOG_SCAN slots at a time.  After that the
+ *  file is only opened when there is something queued.  Returns what the calling service should.
+ **************************************************************************************************/
+uint32_t EventLog::service(void (*written)(const uint8_t*)){
+  if(_nextSequence && _queueOut == _queueIn){
+    return UNIXtime() + 1;                      // Nothing to write, leave the file alone
+  }
+  File eventLog = SD.open(_path, FILE_WRITE);
+  if( ! eventLog){
+    return UNIXtime() + 10;
+  }
+  if( ! _nextSequence){
+    uint32_t sequence;
+    uint32_t slots = eventLog.size() / _recordSize;
+    for(int i=0; i<EVENTLOG_SCAN && _scanSlot < slots; i++, _scanSlot++){
+      eventLog.seek(_scanSlot * _recordSize);
+      eventLog.read((uint8_t*)&sequence, sizeof(sequence));
+      if(sequence > _maxSequence) _maxSequence = sequence;
+    }
+    eventLog.close();
+    if(_scanSlot < slots) return 1;
+    _nextSequence = _maxSequence + 1;
+    return 1;
+  }
+  while(_queueOut != _queueIn){
+    uint8_t* record = _queue + (_queueOut % _queueSize) * _recordSize;
+    memcpy(record, &_nextSequence, sizeof(_nextSequence));
+    eventLog.seek(((_nextSequence - 1) % _slots) * _recordSize);
+    if(eventLog.write(record, _recordSize) != _recordSize) break;
+    _nextSequence++;
+    _queueOut++;
+    if(written) written(record);
+  }
+  eventLog.close();
+  return UNIXtime() + 1;
+}
+
+bool EventLog::ready(){
+  return _nextSequence != 0;
+}
+
+uint32_t EventLog::oldest(){
+  return _nextSequence > _slots ? _nextSequence - _slots : 1;
+}
+
+uint32_t EventLog::next(){
+  return _nextSequence;
+}
+
+int EventLog::read(File& eventLog, uint32_t sequence, uint8_t* record){
+  eventLog.seek(((sequence - 1) % _slots) * _recordSize);
+  if(eventLog.read(record, _recordSize) != _recordSize) return -1;
+  uint32_t recordSequence;
+  memcpy(&recordSequence, record, sizeof(recordSequence));
+  return recordSequence == sequence ? 1 : 0;
+}
+
+uint32_t EventLog::dropped(){
+  return _dropped;
+}
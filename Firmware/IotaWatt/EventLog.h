@@ -0,0 +1,85 @@
+/*
+  EventLog.h - fixed size event logs on the SD card, for power quality and load events.
+*/
+
+#ifndef EventLog_h
+#define EventLog_h
+#include <Arduino.h>
+#include <SD.h>
+
+/*******************************************************************************************************
+********************************************************************************************************
+Class EventLog
+
+A file of a fixed number of fixed size slots, used round robin, so it never grows beyond slots x record
+size.  Each record starts with a uint32_t sequence number, from 1, zero for an unused slot.  Event n is
+in slot (n-1) % slots, so the newest is found at startup by scanning for the highest sequence, and the
+oldest are overwritten.
+
+Events are queued by the detector (queueSlot to get an entry, fill it but for the sequence, queued to add
+it), and written by the owner's service calling service().  The queue is the owner's, an array of
+queueSize records.  Queries read by sequence, from oldest() up to next().
+
+********************************************************************************************************
+********************************************************************************************************/
+
+#define EVENTLOG_SCAN 256					// Slots read per service() while scanning
+
+class EventLog
+{
+  public:
+		EventLog(const String& path, size_t recordSize, uint32_t slots, uint8_t* queue, uint32_t queueSize);
+		uint8_t* queueSlot();				// Entry to fill, nullptr (and dropped) if the queue is full
+		void queued();						// Add the entry filled
+		uint32_t service(void (*written)(const uint8_t* /* record */) = nullptr);
+		bool ready();						// The log has been scanned
+		uint32_t oldest();					// Sequence of the oldest event the log can hold
+		uint32_t next();					// Sequence the next event will have
+		int read(File&, uint32_t sequence, uint8_t* record);	// 1 read, 0 overwritten/unused, -1 failed
+		uint32_t dropped();
+
+  private:
+
+	const String& _path;
+	size_t _recordSize;
+	uint32_t _slots;
+	uint8_t* _queue;
+	uint32_t _queueSize;
+	uint32_t _queueIn = 0;					// Added, wraps
+	uint32_t _queueOut = 0;					// Written, wraps
+	uint32_t _dropped = 0;					// Queue full
+	uint32_t _nextSequence = 0;				// Zero until the log has been scanned
+	uint32_t _scanSlot = 0;
+	uint32_t _maxSequence = 0;
+};
+
+/*******************************************************************************************************
+Class CycleCost
+
+Counts the CPU cycles of code in the sampling path: the average and most per call, in microseconds.
+********************************************************************************************************/
+
+class CycleCost
+{
+  public:
+		void count(uint32_t cycles){
+			if(_cycles + cycles < _cycles){		// Total wraps, start over
+				_cycles = 0;
+				_calls = 0;
+			}
+			_cycles += cycles;
+			_calls++;
+			if(cycles > _maxCycles) _maxCycles = cycles;
+		}
+		uint32_t calls(){return _calls;}
+		float avgus(){return _calls ? float(_cycles) / _calls / ESP.getCpuFreqMHz() : 0.0;}
+		float maxus(){return float(_maxCycles) / ESP.getCpuFreqMHz();}
+
+  private:
+
+	uint32_t _calls = 0;
+	uint32_t _cycles = 0;
+	uint32_t _maxCycles = 0;
+};
+
+#endif
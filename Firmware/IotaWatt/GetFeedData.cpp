@@ -12,8 +12,17 @@
  *  this SERVICE returns with code 0 to cause it's serviceBlock to be deleted.  When a new /feed/data
  *  request comes in, the web server handler will reshedule this SERVICE with NewService.
  * 
+ *  Requests have to get past admission control (admission.cpp) first, and the time spent on them
+ *  is charged to it.  Long requests are done a slice at a time, so sampling carries on.
+ * 
+ *  The frequency range (QUERY_FREQUENCY_MIN/MAX) is kept in each log record, so it means reading
+ *  all of the records in each interval.  That's limited to FREQUENCY_RANGE_RECORDS a point, and
+ *  sliced like everything else, so a point can take more than one turn.
+ * 
  **************************************************************************************************/
 
+static bool frequencyRange(IotaLog* log, uint32_t key, uint32_t span, IotaLogRecord* logRecord, float* min, float* max, uint32_t exitTime);
+
 uint32_t handleGetFeedData(struct serviceBlock* _serviceBlock){
   // trace T_GFD
   enum   states {Initialize, Setup, process};
@@ -33,13 +42,22 @@ uint32_t handleGetFeedData(struct serviceBlock* _serviceBlock){
   static int voltageChannel = 0;
   static boolean Kwh = false;
   static String replyData = "";
+  static IotaLog* queryLog = &iotaLog;
+  static IotaLogRecord* outRecord = nullptr;
+  static IotaLogRecord* lastOutRecord = nullptr;
+  static boolean useOutputLog = false;
+  static GzipStream* gzip = nullptr;
+  static boolean HzRange = false;             // Frequency range asked for
+  static float HzMin;                         // and for the current point
+  static float HzMax;
     
   struct req {
     req* next;
     int channel;
     int queryType;
     Script* output;
-    req(){next=nullptr; channel=0; queryType=0; output=nullptr;};
+    int column;                             // Output log column, -1 to run the Script
+    req(){next=nullptr; channel=0; queryType=0; output=nullptr; column=-1;};
     ~req(){delete next;};
   } static reqRoot;
      
@@ -57,16 +75,6 @@ uint32_t handleGetFeedData(struct serviceBlock* _serviceBlock){
       startUnixTime = server.arg("start").substring(0,10).toInt();
       endUnixTime = server.arg("end").substring(0,10).toInt();
       intervalSeconds = server.arg("interval").toInt();
-      if((startUnixTime % 5) ||
-         (endUnixTime % 5) ||
-         (intervalSeconds % 5) ||
-         (intervalSeconds <= 0) ||
-         (endUnixTime < startUnixTime)){
-        server.send(400, "text/plain", "Invalid request");
-        state = Setup;
-        serverAvailable = true;
-        return 0;    
-      }
       
           // Parse the ID parm into a list.
       
@@ -97,13 +105,119 @@ uint32_t handleGetFeedData(struct serviceBlock* _serviceBlock){
           reqPtr->output = script;
         }
       }
-          
-      
+
+          // Input channels must exist.
+
+      for(reqPtr = reqRoot.next; reqPtr; reqPtr = reqPtr->next){
+        if(reqPtr->channel < 100 && (reqPtr->channel < 0 || reqPtr->channel >= maxInputs || ! inputChannel[reqPtr->channel])){
+          server.send(400, "text/plain", "Invalid request");
+          delete reqRoot.next;
+          state = Setup;
+          serverAvailable = true;
+          return 0;
+        }
+      }
+
+          // Times must fall on the log's interval.
+          // If they don't fall on the main log's, try the fast log.
+
+      queryLog = &iotaLog;
+      if(((startUnixTime % iotaLog.interval()) ||
+          (endUnixTime % iotaLog.interval()) ||
+          (intervalSeconds % iotaLog.interval())) && fastLog.isOpen()){
+        static bool covered;
+        covered = true;
+        for(reqPtr = reqRoot.next; reqPtr; reqPtr = reqPtr->next){
+          if(reqPtr->queryType == QUERY_FREQUENCY_MIN || reqPtr->queryType == QUERY_FREQUENCY_MAX){
+            covered = false;                            // Not kept in the (packed) fast log
+          }
+          else if(reqPtr->channel < 100){
+            if(reqPtr->channel >= MAXINPUTS || ! (fastLog.channelMap() & (1 << reqPtr->channel))) covered = false;
+          }
+          else if(reqPtr->output){
+            reqPtr->output->run([](int i, Script::measures measure)->double {
+              if( ! (fastLog.channelMap() & (1 << i))) covered = false;
+              return 1.0;});
+          }
+        }
+        if(covered) queryLog = &fastLog;
+      }
+      uint32_t logInterval = queryLog->interval();
+      if((startUnixTime % logInterval) ||
+         (endUnixTime % logInterval) ||
+         (intervalSeconds % logInterval) ||
+         (intervalSeconds <= 0) ||
+         (endUnixTime < startUnixTime)){
+        server.send(400, "text/plain", "Invalid request");
+        delete reqRoot.next;
+        state = Setup;
+        serverAvailable = true;
+        return 0;    
+      }
+
+      HzRange = false;
+      for(reqPtr = reqRoot.next; reqPtr; reqPtr = reqPtr->next){
+        if(reqPtr->channel < 100 && (reqPtr->queryType == QUERY_FREQUENCY_MIN || reqPtr->queryType == QUERY_FREQUENCY_MAX)){
+          HzRange = true;
+        }
+      }
+      if(HzRange && intervalSeconds / logInterval > FREQUENCY_RANGE_RECORDS){
+        server.send(400, "text/plain", "Interval too long for frequency range");
+        delete reqRoot.next;
+        state = Setup;
+        serverAvailable = true;
+        return 0;    
+      }
+     
+          // Admission control, by the number of values asked for.
+
+      uint32_t cost = 0;
+      for(reqPtr = reqRoot.next; reqPtr; reqPtr = reqPtr->next){
+        cost += (endUnixTime - startUnixTime) / intervalSeconds + 1;
+      }
+      if(HzRange){
+        cost += (endUnixTime - startUnixTime) / queryLog->interval();
+      }
+      uint32_t retryAfter;
+      if(int code = admitRequest(cost, &retryAfter)){
+        server.sendHeader("Retry-After", String(retryAfter));
+        server.send(code, "text/plain", code == 429 ? "Too many requests" : "Busy");
+        delete reqRoot.next;
+        state = Setup;
+        serverAvailable = true;
+        return 0;
+      }
      
-      if(startUnixTime >= iotaLog.firstKey()){   
+      if(startUnixTime >= queryLog->firstKey()){   
         lastRecord->UNIXtime = startUnixTime - intervalSeconds;
       } else {
-        lastRecord->UNIXtime = iotaLog.firstKey();
+        lastRecord->UNIXtime = queryLog->firstKey();
+      }
+
+          // Outputs kept in the output log are read from there, if the
+          // whole range was computed by the current Script.  Energy is the column plus
+          // its base, from the record the base was taken at.
+
+      useOutputLog = false;
+      if(queryLog == &iotaLog){
+        for(reqPtr = reqRoot.next; reqPtr; reqPtr = reqPtr->next){
+          int column = outputLogColumn(reqPtr->output);
+          if(reqPtr->channel >= 100 && column >= 0){
+            uint32_t since = reqPtr->queryType == QUERY_ENERGY ? outputLogOrigin(column) : outputLogSince(column);
+            if(since && lastRecord->UNIXtime >= since){
+              reqPtr->column = column;
+              useOutputLog = true;
+            }
+          }
+        }
+      }
+      if(useOutputLog){
+        if( ! outRecord){
+          outRecord = new IotaLogRecord;
+          lastOutRecord = new IotaLogRecord;
+        }
+        lastOutRecord->UNIXtime = lastRecord->UNIXtime;
+        outputLog.readKey(lastOutRecord);
       }
 
           // Using String for a large buffer abuses the heap
@@ -113,6 +227,20 @@ uint32_t handleGetFeedData(struct serviceBlock* _serviceBlock){
 
       bufrSize = ESP.getFreeHeap() / 2;
       if(bufrSize > 4096) bufrSize = 4096;
+
+          // Compress if the client can take it, there's enough to be worth it and
+          // the heap can spare the GzipStream.  The compressed data goes out in chunks
+          // of its own, so the buffer is only needed for the terminating chunk.
+
+      int reqCount = 0;
+      for(reqPtr = reqRoot.next; reqPtr; reqPtr = reqPtr->next) reqCount++;
+      uint32_t replySize = ((endUnixTime - startUnixTime) / intervalSeconds + 1) * (3 + reqCount * 8);
+      if(replySize >= GZIP_MIN_RESPONSE && acceptsGzip() &&
+         ESP.getFreeHeap() >= GZIP_HEAP + GZIP_HEAP_RESERVE){
+        gzip = new GzipStream(sendChunked);
+        server.sendHeader("Content-Encoding", "gzip");
+        bufrSize = 8;
+      }
       bufr = new char [bufrSize];
 
           // Setup buffer to do it "chunky-style"
@@ -136,13 +264,23 @@ uint32_t handleGetFeedData(struct serviceBlock* _serviceBlock){
     case process: {
       trace(T_GFD,1);
       uint32_t exitTime = nextCrossMs + 5000 / frequency;              // Take an additional half cycle
+      uint32_t startMs = millis();
       SPI.beginTransaction(SPISettings(SPI_FULL_SPEED, MSBFIRST, SPI_MODE0));
 
           // Loop to generate entries
       
       while(UnixTime <= endUnixTime) {
         logRecord->UNIXtime = UnixTime;
-        int rtc = iotaLog.readKey(logRecord);
+        int rtc = queryLog->readKey(logRecord);
+        int outRtc = 1;
+        if(useOutputLog){
+          outRecord->UNIXtime = UnixTime;
+          outRtc = outputLog.readKey(outRecord);
+        }
+        if(HzRange && ! rtc && ! frequencyRange(queryLog, UnixTime, intervalSeconds, logRecord, &HzMin, &HzMax, exitTime)){
+          admissionCharge(millis() - startMs);
+          return 1;                                   // Carry on with this point next time
+        }
         trace(T_GFD,2);
         replyData += '[';  //  + String(UnixTime) + "000,";
         elapsedHours = logRecord->logHours - lastRecord->logHours;
@@ -165,23 +303,82 @@ uint32_t handleGetFeedData(struct serviceBlock* _serviceBlock){
             }
             else if(reqPtr->queryType == QUERY_ENERGY) {
               replyData += String((logRecord->channel[channel].accum1 / 1000.0),2);
-            }  
+            }
+            else if(reqPtr->queryType == QUERY_IMPORT && logsExport(channel)) {
+              replyData += String(((logRecord->channel[channel].accum1 + logRecord->channel2[channel].accum2) / 1000.0),2);
+            }
+            else if(reqPtr->queryType == QUERY_EXPORT && logsExport(channel)) {
+              replyData += String((logRecord->channel2[channel].accum2 / 1000.0),2);
+            }
+            else if(reqPtr->queryType == QUERY_CYCLES) {
+              replyData += String(logRecord->count[channel].cycles - lastRecord->count[channel].cycles);
+            }
+            else if(reqPtr->queryType == QUERY_FAILURES) {
+              replyData += String(logRecord->count[channel].failures - lastRecord->count[channel].failures);
+            }
+            else if(reqPtr->queryType == QUERY_FREQUENCY) {
+              double HzHrs = logRecord->channel2[channel].accum2 - lastRecord->channel2[channel].accum2;
+              if(HzHrs > 0 && inputChannel[channel]->_type == channelTypeVoltage){
+                replyData += String(HzHrs / elapsedHours, 3);
+              }
+              else {
+                replyData += "null";
+              }
+            }
+            else if(reqPtr->queryType == QUERY_FREQUENCY_MIN || reqPtr->queryType == QUERY_FREQUENCY_MAX) {
+              if(HzMax > 0){
+                replyData += String(reqPtr->queryType == QUERY_FREQUENCY_MIN ? HzMin : HzMax, 3);
+              }
+              else {
+                replyData += "null";
+              }
+            }
+            else {
+              replyData += "null";
+            }
           }
   
            // output channel
           
           else {
             trace(T_GFD,4);
-            if(reqPtr->output == nullptr){
+            if(reqPtr->output == nullptr ||
+               reqPtr->queryType == QUERY_IMPORT ||
+               reqPtr->queryType == QUERY_EXPORT ||
+               reqPtr->queryType == QUERY_CYCLES ||
+               reqPtr->queryType == QUERY_FAILURES ||
+               reqPtr->queryType == QUERY_FREQUENCY ||
+               reqPtr->queryType == QUERY_FREQUENCY_MIN ||
+               reqPtr->queryType == QUERY_FREQUENCY_MAX){
               replyData += "null";
             }
+            else if(reqPtr->column >= 0 && reqPtr->queryType == QUERY_ENERGY){
+              int column = reqPtr->column;
+              if(outRtc){
+                replyData += "null";
+              }
+              else {
+                replyData += String((outRecord->channel[column].accum1 + outputLogBase(column)) / 1000.0, 2);
+              }
+            }
+            else if(reqPtr->column >= 0){
+              int column = reqPtr->column;
+              if(outRtc || outRecord->logHours == lastOutRecord->logHours){
+                replyData += "null";
+              }
+              else {
+                replyData += String((outRecord->channel[column].accum1 - lastOutRecord->channel[column].accum1) /
+                                    (outRecord->logHours - lastOutRecord->logHours), 1);
+              }
+            }
             else if(reqPtr->queryType == QUERY_ENERGY){
-              replyData += String(reqPtr->output->run([](int i)->double {
-                return logRecord->channel[i].accum1 / 1000.0;}), 2);
+              replyData += String(reqPtr->output->run([](int i, Script::measures measure)->double {
+                return Script::measured(measure, logRecord->channel[i].accum1, logsExport(i) ? logRecord->channel2[i].accum2 : 0) / 1000.0;}), 2);
             }
             else {
-              replyData += String(reqPtr->output->run([](int i)->double {
-                return (logRecord->channel[i].accum1 - lastRecord->channel[i].accum1) / elapsedHours;}), 1);
+              replyData += String(reqPtr->output->run([](int i, Script::measures measure)->double {
+                return Script::measured(measure, logRecord->channel[i].accum1 - lastRecord->channel[i].accum1,
+                                        logsExport(i) ? logRecord->channel2[i].accum2 - lastRecord->channel2[i].accum2 : 0) / elapsedHours;}), 1);
             }
           }
           replyData += ',';
@@ -191,38 +388,64 @@ uint32_t handleGetFeedData(struct serviceBlock* _serviceBlock){
         swapRecord = lastRecord;
         lastRecord = logRecord;
         logRecord = swapRecord;
+        if(useOutputLog){
+          swapRecord = lastOutRecord;
+          lastOutRecord = outRecord;
+          outRecord = swapRecord;
+        }
         UnixTime += intervalSeconds;
 
             // When buffer is full, send a chunk.
         
         trace(T_GFD,5);
-        if((bufrSize - bufrPos - 5) < replyData.length()){
-          trace(T_GFD,6);
-          sendChunk(bufr, bufrPos);
-          bufrPos = 5;
+        if(gzip){
+          gzip->write(replyData);
         }
+        else {
+          if((bufrSize - bufrPos - 5) < replyData.length()){
+            trace(T_GFD,6);
+            sendChunk(bufr, bufrPos);
+            bufrPos = 5;
+          }
 
             // Copy this element into the buffer
         
-        for(int i = 0; i < replyData.length(); i++) {
-          bufr[bufrPos++] = replyData[i];  
+          for(int i = 0; i < replyData.length(); i++) {
+            bufr[bufrPos++] = replyData[i];  
+          }
         }
         replyData = ',';
+
+            // Give sampling a turn if this is taking a while.
+
+        if((int32_t)(millis() - exitTime) >= 0 && UnixTime <= endUnixTime){
+          admissionCharge(millis() - startMs);
+          return 1;
+        }
       }
       trace(T_GFD,7);
 
           // All entries generated, terminate Json and send.
       
       replyData.setCharAt(replyData.length()-1,']');
-      for(int i = 0; i < replyData.length(); i++) {
-        bufr[bufrPos++] = replyData[i];  
+      if(gzip){
+        gzip->write(replyData);
+        gzip->finish();
+        delete gzip;
+        gzip = nullptr;
+      }
+      else {
+        for(int i = 0; i < replyData.length(); i++) {
+          bufr[bufrPos++] = replyData[i];  
+        }
+        sendChunk(bufr, bufrPos); 
       }
-      sendChunk(bufr, bufrPos); 
 
           // Send terminating zero chunk, clean up and exit.
       
       sendChunk(bufr, 5); 
       trace(T_GFD,7);
+      admissionCharge(millis() - startMs);
       delete reqRoot.next;
       delete[] bufr;
       state = Setup;
@@ -232,6 +455,35 @@ uint32_t handleGetFeedData(struct serviceBlock* _serviceBlock){
   }
 }
 
+/***************************************************************************************************
+ *  frequencyRange() - Lowest and highest frequency in the span seconds up to key, from the log
+ *  records in it (logRecord is the one at key).  Zero if none were recorded.  Stops at exitTime
+ *  (after at least one record) and returns false, to be called again for the same key.
+ **************************************************************************************************/
+static bool frequencyRange(IotaLog* log, uint32_t key, uint32_t span, IotaLogRecord* logRecord, float* min, float* max, uint32_t exitTime){
+  static IotaLogRecord* record = nullptr;
+  static uint32_t rangeKey = 0;                     // Point in progress
+  static uint32_t recordKey;                        // Next record of it
+  if(key != rangeKey){
+    rangeKey = key;
+    recordKey = key - span + log->interval();
+    *min = logRecord->Hz.min;
+    *max = logRecord->Hz.max;
+  }
+  if( ! record) record = new IotaLogRecord;
+  while(recordKey < key){
+    record->UNIXtime = recordKey;
+    recordKey += log->interval();
+    if( ! log->readKey(record) && record->Hz.max > 0){
+      if(*max == 0 || record->Hz.min < *min) *min = record->Hz.min;
+      if(record->Hz.max > *max) *max = record->Hz.max;
+    }
+    if((int32_t)(millis() - exitTime) >= 0 && recordKey < key) return false;
+  }
+  rangeKey = 0;
+  return true;
+}
+
 void sendChunk(char* bufr, uint32_t bufrPos){
   trace(T_GFD,9);
   const char* hexDigit = "0123456789ABCDEF";
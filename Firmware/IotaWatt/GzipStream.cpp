@@ -0,0 +1,173 @@
+/*
+  GzipStream.cpp - gzip compression of a stream of output, for the web server.
+*/
+
+#include "GzipStream.h"
+
+static const uint16_t lengthBase [29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,
+										35,43,51,59,67,83,99,115,131,163,195,227,258};
+static const uint8_t lengthExtra [29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+static const uint16_t distBase [20] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769};
+static const uint8_t distExtra [20] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8};
+static const uint32_t crcTable [16] = {0x00000000,0x1DB71064,0x3B6E20C8,0x26D930AC,0x76DC4190,0x6B6B51F4,0x4DB26158,0x5005713C,
+										0xEDB88320,0xF00F9344,0xD6D6A3E8,0xCB61B38C,0x9B64C2B0,0x86D3D2D4,0xA00AE278,0xBDBDF21C};
+
+	GzipStream::GzipStream(void (*sink)(const uint8_t*, size_t)){
+		_sink = sink;
+		_buf = new uint8_t [GZIP_BUFFER];
+		_head = new uint16_t [GZIP_HASH];
+		memset(_head, 0, GZIP_HASH * sizeof(uint16_t));
+		_out = new uint8_t [GZIP_OUT];
+
+				// gzip header: deflate, no name, no time, unknown OS.
+				// Then a (non-final) block with the fixed codes.
+
+		const uint8_t header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 0xff};
+		for(int i=0; i<10; i++) putByte(header[i]);
+		putBits(0, 1);
+		putBits(1, 2);
+	}
+
+	GzipStream::~GzipStream(){
+		delete[] _buf;
+		delete[] _head;
+		delete[] _out;
+	}
+
+	void GzipStream::write(const uint8_t* data, size_t length){
+		while(length){
+			size_t count = GZIP_BUFFER - _bufLen;
+			if(count > length) count = length;
+			for(size_t i=0; i<count; i++){
+				uint8_t byte = data[i];
+				_buf[_bufLen++] = byte;
+				_crc ^= byte;
+				_crc = (_crc >> 4) ^ crcTable[_crc & 15];
+				_crc = (_crc >> 4) ^ crcTable[_crc & 15];
+			}
+			_inBytes += count;
+			data += count;
+			length -= count;
+			if(_bufLen == GZIP_BUFFER){
+				compress(false);
+			}
+		}
+	}
+
+	void GzipStream::write(const String& str){
+		write((const uint8_t*)str.c_str(), str.length());
+	}
+
+			// finish() - End the block, add an empty final block and the trailer (CRC and length).
+
+	void GzipStream::finish(){
+		compress(true);
+		putCode(0, 7);
+		putBits(1, 1);
+		putBits(1, 2);
+		putCode(0, 7);
+		if(_bitCount){
+			putBits(0, 8 - _bitCount);
+		}
+		uint32_t crc = ~_crc;
+		for(int i=0; i<4; i++) putByte(crc >> (i * 8));
+		for(int i=0; i<4; i++) putByte(_inBytes >> (i * 8));
+		flushOut();
+	}
+
+	uint32_t GzipStream::inBytes(){return _inBytes;}
+	uint32_t GzipStream::outBytes(){return _outBytes + _outPos;}
+
+			// compress() - Code the buffer up to where there's a full match length of lookahead
+			// left (all of it if final), then slide the buffer down to keep a window of history.
+
+	void GzipStream::compress(boolean final){
+		uint32_t limit = final ? _bufLen : _bufLen - GZIP_MAX_MATCH;
+		while(_pos < limit){
+			if(_pos + 3 <= _bufLen){
+				uint32_t hash = ((_buf[_pos] << 6) ^ (_buf[_pos+1] << 3) ^ _buf[_pos+2]) % GZIP_HASH;
+				uint32_t candidate = _head[hash];
+				_head[hash] = _pos + 1;
+				if(candidate && _pos - (candidate - 1) <= GZIP_WINDOW){
+					uint32_t match = candidate - 1;
+					uint32_t maxLength = _bufLen - _pos;
+					if(maxLength > GZIP_MAX_MATCH) maxLength = GZIP_MAX_MATCH;
+					uint32_t length = 0;
+					while(length < maxLength && _buf[match + length] == _buf[_pos + length]) length++;
+					if(length >= 3){
+						putMatch(length, _pos - match);
+						for(uint32_t i=1; i<length && _pos + i + 3 <= _bufLen; i++){
+							uint32_t p = _pos + i;
+							_head[((_buf[p] << 6) ^ (_buf[p+1] << 3) ^ _buf[p+2]) % GZIP_HASH] = p + 1;
+						}
+						_pos += length;
+						continue;
+					}
+				}
+			}
+			putLiteral(_buf[_pos++]);
+		}
+		if(final || _pos <= GZIP_WINDOW) return;
+		uint32_t shift = _pos - GZIP_WINDOW;
+		memmove(_buf, _buf + shift, _bufLen - shift);
+		_bufLen -= shift;
+		_pos -= shift;
+		for(int i=0; i<GZIP_HASH; i++){
+			_head[i] = _head[i] > shift ? _head[i] - shift : 0;
+		}
+	}
+
+			// Bits go out least significant first.  Huffman codes go most significant first,
+			// so they're reversed.
+
+	void GzipStream::putBits(uint32_t bits, int count){
+		_bitBuf |= bits << _bitCount;
+		_bitCount += count;
+		while(_bitCount >= 8){
+			putByte(_bitBuf);
+			_bitBuf >>= 8;
+			_bitCount -= 8;
+		}
+	}
+
+	void GzipStream::putCode(uint32_t code, int length){
+		uint32_t reversed = 0;
+		for(int i=0; i<length; i++){
+			reversed = (reversed << 1) | (code & 1);
+			code >>= 1;
+		}
+		putBits(reversed, length);
+	}
+
+	void GzipStream::putLiteral(int value){
+		if(value < 144) putCode(0x30 + value, 8);
+		else putCode(0x190 + value - 144, 9);
+	}
+
+	void GzipStream::putMatch(int length, int distance){
+		int i = 28;
+		while(lengthBase[i] > length) i--;
+		int symbol = 257 + i;
+		if(symbol < 280) putCode(symbol - 256, 7);
+		else putCode(0xC0 + symbol - 280, 8);
+		putBits(length - lengthBase[i], lengthExtra[i]);
+		int j = 19;
+		while(distBase[j] > distance) j--;
+		putCode(j, 5);
+		putBits(distance - distBase[j], distExtra[j]);
+	}
+
+	void GzipStream::putByte(uint8_t byte){
+		_out[_outPos++] = byte;
+		if(_outPos == GZIP_OUT){
+			flushOut();
+		}
+	}
+
+	void GzipStream::flushOut(){
+		if(_outPos){
+			_sink(_out, _outPos);
+			_outBytes += _outPos;
+			_outPos = 0;
+		}
+	}
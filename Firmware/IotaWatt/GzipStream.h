@@ -0,0 +1,66 @@
+/*
+  GzipStream.h - gzip compression of a stream of output, for the web server.
+*/
+
+#ifndef GzipStream_h
+#define GzipStream_h
+#include <Arduino.h>
+
+/*******************************************************************************************************
+********************************************************************************************************
+Class GzipStream
+
+Compresses whatever is written to it into gzip format (RFC 1952/1951), passing the compressed bytes to
+the sink function as they're produced, so a response can be sent as it's generated.
+
+It's a cut down deflate to suit the ESP8266: LZ77 over a 1K window with one candidate match per hash,
+coded with the fixed Huffman codes, so there are no code tables to build or send.  It uses about 3.5K of
+heap and little more CPU than copying the data.  The repetitive JSON the server sends typically comes
+out at a third of its size or less.
+
+********************************************************************************************************
+********************************************************************************************************/
+
+#define GZIP_WINDOW 1024					// Farthest back a match can be
+#define GZIP_BUFFER 2048					// Window plus lookahead
+#define GZIP_HASH 512						// Hash table entries
+#define GZIP_OUT 512						// Output buffered for the sink
+#define GZIP_MAX_MATCH 258
+#define GZIP_HEAP (GZIP_BUFFER + GZIP_HASH * 2 + GZIP_OUT)	// Heap a GzipStream uses
+
+class GzipStream
+{
+  public:
+		GzipStream(void (*sink)(const uint8_t* /* data */, size_t /* length */));
+		~GzipStream();
+		void write(const uint8_t* /* data */, size_t /* length */);
+		void write(const String&);
+		void finish();						// Compress what's left and add the trailer
+		uint32_t inBytes();
+		uint32_t outBytes();
+
+  private:
+
+	void (*_sink)(const uint8_t*, size_t);
+	uint8_t* _buf;							// History and lookahead
+	uint16_t* _head;						// Last position+1 of each hash, 0 for none
+	uint8_t* _out;
+	uint32_t _bufLen = 0;
+	uint32_t _pos = 0;						// Next position to compress
+	uint32_t _outPos = 0;
+	uint32_t _bitBuf = 0;
+	int _bitCount = 0;
+	uint32_t _crc = 0xFFFFFFFF;
+	uint32_t _inBytes = 0;
+	uint32_t _outBytes = 0;
+
+	void compress(boolean final);
+	void putBits(uint32_t bits, int count);
+	void putCode(uint32_t code, int length);
+	void putLiteral(int value);
+	void putMatch(int length, int distance);
+	void putByte(uint8_t byte);
+	void flushOut();
+};
+
+#endif
@@ -47,6 +47,12 @@ class IotaInputChannel {
     bool         _signed;                     // True if channel should not be reversed when negative (net metered main)
     const double MS_PER_HOUR = 3600000UL;     // useful constant
     dataBuckets   dataBucket;
+    double       importWattHrs;               // Power channels: watt-hours while power was positive
+    double       exportWattHrs;               //                 watt-hours while power was negative
+    uint32_t     cycleCount;                  // Cycles successfully sampled (wraps)
+    uint32_t     cycleFailures;               // Cycles rejected or failed (wraps)
+    float        HzMin;                       // Voltage channels: lowest and highest frequency
+    float        HzMax;                       //                   since dataLog last took them
     
 
     IotaInputChannel(uint8_t channel){
@@ -64,6 +70,12 @@ class IotaInputChannel {
 	  _active = false;
     _reversed = false;
     _signed = false;
+    importWattHrs = 0;
+    exportWattHrs = 0;
+    cycleCount = 0;
+    cycleFailures = 0;
+    HzMin = 0;
+    HzMax = 0;
     }
 	~IotaInputChannel(){
 		
@@ -81,13 +93,40 @@ class IotaInputChannel {
     _signed = false;
 	}
 	
+		// accum1 is the net value*hours.  For power channels, the same product is also split by
+		// sign into import and export, so that a net metered main that flows both ways within
+		// a log interval reports both directions instead of just the difference.
+
     void ageBuckets(uint32_t timeNow) {
 		double elapsedHrs = double((uint32_t)(timeNow - dataBucket.timeThen)) / MS_PER_HOUR;
-		dataBucket.accum1 += dataBucket.value1 * elapsedHrs;
+		double valueHrs = dataBucket.value1 * elapsedHrs;
+		dataBucket.accum1 += valueHrs;
+		if(_type == channelTypePower){
+			if(valueHrs >= 0) importWattHrs += valueHrs;
+			else exportWattHrs -= valueHrs;
+		}
 		dataBucket.accum2 += dataBucket.value2 * elapsedHrs;
 		dataBucket.timeThen = timeNow;    
     }
 
+		// Value*hours as of timeAt, before or after the last update, extrapolated at the current
+		// rate without aging the buckets.
+
+	double accum1At(uint32_t timeAt){
+		return dataBucket.accum1 + dataBucket.value1 * double((int32_t)(timeAt - dataBucket.timeThen)) / MS_PER_HOUR;
+	}
+	double exportWattHrsAt(uint32_t timeAt){
+		if(_type != channelTypePower || dataBucket.value1 >= 0) return exportWattHrs;
+		return exportWattHrs - dataBucket.value1 * double((int32_t)(timeAt - dataBucket.timeThen)) / MS_PER_HOUR;
+	}
+
+		// What dataLog keeps in accum2: export watt-hours for power channels, Hz-hours for voltage channels.
+
+	double logAccum2At(uint32_t timeAt){
+		if(_type != channelTypeVoltage) return exportWattHrsAt(timeAt);
+		return dataBucket.accum2 + dataBucket.value2 * double((int32_t)(timeAt - dataBucket.timeThen)) / MS_PER_HOUR;
+	}
+
 	void setVoltage(float volts, float Hz){
 		if(_type != channelTypeVoltage) return;
 		setVoltage(volts);
@@ -101,7 +140,10 @@ class IotaInputChannel {
 	
 	void setHz(float Hz){
 		if(_type != channelTypeVoltage) return;
+		ageBuckets(millis());
 		dataBucket.Hz = Hz;
+		if(HzMax == 0 || Hz < HzMin) HzMin = Hz;
+		if(Hz > HzMax) HzMax = Hz;
     }
 	
 	void setPower(float watts, float amps){
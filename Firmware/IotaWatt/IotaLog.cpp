@@ -5,9 +5,10 @@
 #include "IotaLog.h"
 	#define PRINT(txt,val) Serial.print(txt); Serial.print(val);      // Quick debug aids
 #define PRINTL(txt,val) Serial.print(txt); Serial.println(val);
-	int IotaLog::begin (char* path){
+	int IotaLog::begin (char* path, uint32_t interval, uint32_t channelMap){
 		logPath = String(path) + ".log";
 		indexPath = String(path) + ".ndx";
+		summaryPath = String(path) + ".sum";
 		if(!SD.exists((char*)logPath.c_str())){
 			if(logPath.lastIndexOf('/') > 0){
 				String  dir = logPath.substring(0,logPath.lastIndexOf('/'));
@@ -27,6 +28,7 @@
 			SD.remove((char*)indexPath.c_str());
 			IotaIndex = SD.open((char*)indexPath.c_str(),FILE_WRITE);
 			IotaIndex.close();
+			SD.remove((char*)summaryPath.c_str());
 		}
 		IotaFile = SD.open((char*)logPath.c_str(), FILE_WRITE);
 		if(!IotaFile){
@@ -35,31 +37,61 @@
 
 		_fileSize = IotaFile.size();
 
-		if(_fileSize % sizeof(IotaLogRecord)){
+				// A new log gets the current header.
+				// An existing log without one is version 0.
+
+		IotaLogHeader header;
+		if(!_fileSize){
+			header.interval = interval;
+			header.channelMap = channelMap;
+			if(channelMap){
+				header.recordSize = packedSize(channelMap);
+			}
+			IotaFile.seek(0);
+			IotaFile.write((char*)&header, sizeof(IotaLogHeader));
+			IotaFile.flush();
+			_fileSize = sizeof(IotaLogHeader);
+		}
+		IotaFile.seek(0);
+		IotaFile.read(&header, sizeof(IotaLogHeader));
+		if(header.magic == IOTALOG_MAGIC){
+			_headerSize = header.headerSize;
+			_recordSize = header.recordSize;
+			_interval = header.interval;
+			_channelMap = header.channelMap;
+		}
+		else {
+			_headerSize = 0;
+			_recordSize = IOTALOG_V0_RECORD;
+			_interval = 5;
+			_channelMap = 0;
+		}
+		if(_recordSize > sizeof(IotaLogRecord) || _fileSize < _headerSize || (_fileSize - _headerSize) % _recordSize){
 			Serial.println(_fileSize);
-			Serial.println(sizeof(IotaLogRecord));
+			Serial.println(_recordSize);
 			IotaFile.close();
 			return 3;
 		}
+		if(_channelMap){
+			_packBuffer = new uint8_t [_recordSize];
+		}
 		record = new IotaLogRecord;
-		if(!_fileSize){
+		_entries = (_fileSize - _headerSize) / _recordSize;
+		if(!_entries){
 			_firstKey = 0;
 			_lastKey = 0;
-			_entries = 0;
 		}
 		else {
-			IotaFile.seek(0);
-			IotaFile.read(record, sizeof(IotaLogRecord));
+			readSerial(0, record);
 			_firstKey = record->UNIXtime;
-			IotaFile.seek(_fileSize-sizeof(IotaLogRecord));
-			IotaFile.read(record, sizeof(IotaLogRecord));
+			readSerial(_entries - 1, record);
 			_lastKey = record->UNIXtime;
-			_entries = _fileSize / sizeof(IotaLogRecord);
 		}
 
 		_L1indexBuffer = new IotaL1indexEntry [64];
 		_L1indexBufferPos = 0xffffffff;
 
+		beginSummary();
 		return buildIndex();
 	}
 
@@ -88,21 +120,37 @@
 		return 0;
 	}
 
-	int IotaLog::write (IotaLogRecord* newRecord){
+	int IotaLog::write (IotaLogRecord* newRecord, boolean flush){
 		if(!IotaFile){
 			return 2;
 		}
 		if(newRecord->UNIXtime <= _lastKey) {
 			return 1;
 		}
-		newRecord->serial = _entries++;
+		newRecord->serial = _entries;
 		IotaFile.seek(_fileSize);
-		IotaFile.write((char*)newRecord, sizeof(IotaLogRecord));
+		size_t written;
+		if(_channelMap){
+			pack(newRecord);
+			written = IotaFile.write((char*)_packBuffer, _recordSize);
+		}
+		else {
+			written = IotaFile.write((char*)newRecord, _recordSize);
+		}
+		if(written != _recordSize){					// Card gone or full
+			return 3;
+		}
+		_entries++;
 		if(_firstKey == 0){
 			_firstKey = newRecord->UNIXtime;
 		}
-		_fileSize += sizeof(IotaLogRecord);
-		IotaFile.flush();
+		_fileSize += _recordSize;
+		if(flush){
+			IotaFile.flush();
+		}
+		if(_summarySerial == newRecord->serial){
+			summarize(newRecord);
+		}
 		if(newRecord->UNIXtime - _lastKey > _interval){
 			IotaIndex.close();
 			IotaIndex = SD.open((char*)indexPath.c_str(),FILE_WRITE);
@@ -155,8 +203,7 @@
 		if(_seriesOffset >= _seriesEntries){
 			_seriesOffset = _seriesEntries - 1;
 		}
-		IotaFile.seek((_seriesSerial + _seriesOffset) * sizeof(IotaLogRecord));
-		IotaFile.read(_callerRecord, sizeof(IotaLogRecord));
+		readSerial(_seriesSerial + _seriesOffset, _callerRecord);
 		_callerRecord->UNIXtime = key;
 		return 0;
 	}
@@ -193,24 +240,96 @@
 		if(callerRecord->serial >= (_entries - 1)){
 			return 1;
 		}
-		IotaFile.seek(sizeof(IotaLogRecord) * (callerRecord->serial+1));
-		IotaFile.read(callerRecord, sizeof(IotaLogRecord));
+		readSerial(callerRecord->serial + 1, callerRecord);
 		return 0;
 	}
 
+			// readSerial() - reads a record by serial number.
+			// Fields beyond the log's record size are zeroed.
+
+	void IotaLog::readSerial(uint32_t serial, IotaLogRecord* callerRecord){
+		IotaFile.seek(_headerSize + serial * _recordSize);
+		if(_channelMap){
+			IotaFile.read(_packBuffer, _recordSize);
+			unpack(callerRecord);
+			return;
+		}
+		IotaFile.read(callerRecord, _recordSize);
+		if(_recordSize < sizeof(IotaLogRecord)){
+			memset((uint8_t*)callerRecord + _recordSize, 0, sizeof(IotaLogRecord) - _recordSize);
+		}
+	}
+
+			// Packed records are the header fields followed by accum1, accum2 and counts
+			// of each mapped channel in channel order.
+
+	#define PACKED_HEADER offsetof(IotaLogRecord, channel)
+	#define PACKED_CHANNEL (sizeof(double) * 2 + sizeof(IotaLogRecord::counts))
+
+	uint32_t IotaLog::packedSize(uint32_t channelMap){
+		uint32_t channels = 0;
+		for(int i=0; i<15; i++){
+			if(channelMap & (1 << i)) channels++;
+		}
+		return PACKED_HEADER + channels * PACKED_CHANNEL;
+	}
+
+	void IotaLog::pack(IotaLogRecord* callerRecord){
+		memcpy(_packBuffer, callerRecord, PACKED_HEADER);
+		uint8_t* ptr = _packBuffer + PACKED_HEADER;
+		for(int i=0; i<15; i++){
+			if(_channelMap & (1 << i)){
+				memcpy(ptr, &callerRecord->channel[i].accum1, sizeof(double));
+				memcpy(ptr + sizeof(double), &callerRecord->channel2[i].accum2, sizeof(double));
+				memcpy(ptr + 2 * sizeof(double), &callerRecord->count[i], sizeof(IotaLogRecord::counts));
+				ptr += PACKED_CHANNEL;
+			}
+		}
+	}
+
+	void IotaLog::unpack(IotaLogRecord* callerRecord){
+		memset(callerRecord, 0, sizeof(IotaLogRecord));
+		memcpy(callerRecord, _packBuffer, PACKED_HEADER);
+		uint8_t* ptr = _packBuffer + PACKED_HEADER;
+		for(int i=0; i<15; i++){
+			if(_channelMap & (1 << i)){
+				memcpy(&callerRecord->channel[i].accum1, ptr, sizeof(double));
+				memcpy(&callerRecord->channel2[i].accum2, ptr + sizeof(double), sizeof(double));
+				memcpy(&callerRecord->count[i], ptr + 2 * sizeof(double), sizeof(IotaLogRecord::counts));
+				ptr += PACKED_CHANNEL;
+			}
+		}
+	}
+
 	int IotaLog::end(){
 		logPath = "";
 		indexPath = "";
 		delete[] _L2index;
+		_L2index = nullptr;
 		delete[] _L1indexBuffer;
+		_L1indexBuffer = nullptr;
+		delete[] _packBuffer;
+		_packBuffer = nullptr;
+		delete record;
+		record = nullptr;
+		delete _summary;
+		_summary = nullptr;
+		_channelMap = 0;
 		_firstKey = 0;
 		_lastKey = 0;
 		_fileSize = 0;
+		_entries = 0;
 		IotaFile.close();
 		IotaIndex.close();
 		return 0;
 	}
 
+	void IotaLog::flush(){
+		if(IotaFile){
+			IotaFile.flush();
+		}
+	}
+
 	boolean IotaLog::isOpen(){
 		if(IotaFile) return true;
 		return false;
@@ -219,3 +338,148 @@
 	uint32_t IotaLog::firstKey(){return _firstKey;}
 	uint32_t IotaLog::lastKey(){return _lastKey;}
 	uint32_t IotaLog::fileSize(){return _fileSize;}
+	uint32_t IotaLog::recordSize(){return _recordSize;}
+	uint32_t IotaLog::interval(){return _interval;}
+	uint32_t IotaLog::channelMap(){return _channelMap;}
+
+			// beginSummary() - Pick up the summary file where it left off.
+			// The block in progress is lost at restart, so summarizing resumes with
+			// the first record of that block.  If the summary doesn't fit this log,
+			// it's started over.
+
+	void IotaLog::beginSummary(){
+		_summaryRecords = _interval < 3600 ? 3600 / _interval : 1;
+		_summaryEntries = 0;
+		File summaryFile = SD.open((char*)summaryPath.c_str(), FILE_READ);
+		if(summaryFile){
+			_summaryEntries = summaryFile.size() / sizeof(IotaLogSummary);
+			if(summaryFile.size() % sizeof(IotaLogSummary) || _summaryEntries * _summaryRecords > _entries){
+				_summaryEntries = 0;
+			}
+			summaryFile.close();
+			if(_summaryEntries == 0){
+				SD.remove((char*)summaryPath.c_str());
+			}
+		}
+		if( ! _summary) _summary = new IotaLogSummary;
+		_summary->reset();
+		_summarySerial = _summaryEntries * _summaryRecords;
+		_prevLogHours = 0;
+		for(int i=0; i<15; i++) _prevAccum1[i] = 0;
+		if(_summarySerial){
+			readSerial(_summarySerial - 1, record);
+			_prevLogHours = record->logHours;
+			for(int i=0; i<15; i++) _prevAccum1[i] = record->channel[i].accum1;
+		}
+	}
+
+			// summarize() - Add the next record to the block in progress,
+			// and append the block to the summary file when it's complete.
+
+	void IotaLog::summarize(IotaLogRecord* callerRecord){
+		if(_summarySerial % _summaryRecords == 0){
+			_summary->reset();
+			_summary->firstKey = callerRecord->UNIXtime;
+		}
+		double elapsedHours = callerRecord->logHours - _prevLogHours;
+		for(int i=0; i<15; i++){
+			if(_summarySerial && elapsedHours > 0){
+				float value = (callerRecord->channel[i].accum1 - _prevAccum1[i]) / elapsedHours;
+				if(value < _summary->channel[i].min) _summary->channel[i].min = value;
+				if(value > _summary->channel[i].max) _summary->channel[i].max = value;
+			}
+			_prevAccum1[i] = callerRecord->channel[i].accum1;
+			_summary->channel[i].accum1 = callerRecord->channel[i].accum1;
+		}
+		_prevLogHours = callerRecord->logHours;
+		_summary->lastKey = callerRecord->UNIXtime;
+		_summary->logHours = callerRecord->logHours;
+		if(++_summarySerial % _summaryRecords == 0){
+			File summaryFile = SD.open((char*)summaryPath.c_str(), FILE_WRITE);
+			if(summaryFile){
+				summaryFile.seek(_summaryEntries * sizeof(IotaLogSummary));
+				summaryFile.write((uint8_t*)_summary, sizeof(IotaLogSummary));
+				summaryFile.close();
+				_summaryEntries++;
+			}
+		}
+	}
+
+			// updateSummary() - Summarize up to maxRecords records that were written
+			// before the summary was caught up.  Returns the number still behind.
+
+	uint32_t IotaLog::updateSummary(uint32_t maxRecords){
+		if(!IotaFile || !_summary){
+			return 0;
+		}
+		while(maxRecords-- && _summarySerial < _entries){
+			readSerial(_summarySerial, record);
+			summarize(record);
+		}
+		return _entries - _summarySerial;
+	}
+
+			// minMax() - Lowest and highest period average of a channel between two keys.
+			// Whole blocks come from the summary, the rest from the log.  min and max are
+			// only ever lowered and raised, so start them at FLT_MAX and -FLT_MAX.  After
+			// maxReads blocks and records, returns 3 with startKey moved up to where it left
+			// off, to be called again.  Returns 1 if there are no records in the range, 2 if
+			// it would take more than the partial blocks at either end from the log (the
+			// summary is behind).
+
+	int IotaLog::minMax(uint32_t* startKey, uint32_t endKey, int channel, double* min, double* max, uint32_t maxReads){
+		if(!IotaFile || _entries == 0 || channel < 0 || channel >= 15){
+			return 1;
+		}
+		if(*startKey < _firstKey) *startKey = _firstKey;
+		if(endKey > _lastKey) endKey = _lastKey;
+		if(endKey <= *startKey){
+			return *max < *min ? 1 : 0;
+		}
+		IotaLogRecord* logRecord = new IotaLogRecord;
+		logRecord->UNIXtime = endKey;
+		readKey(logRecord);
+		uint32_t endSerial = logRecord->serial;
+		logRecord->UNIXtime = *startKey;
+		readKey(logRecord);
+		uint32_t serial = logRecord->serial + 1;
+		uint32_t summarized = _summaryEntries * _summaryRecords;
+		if(endSerial >= summarized && endSerial - (serial > summarized ? serial : summarized) >= _summaryRecords){
+			delete logRecord;
+			return 2;
+		}
+		double prevAccum1 = logRecord->channel[channel].accum1;
+		double prevLogHours = logRecord->logHours;
+		File summaryFile = SD.open((char*)summaryPath.c_str(), FILE_READ);
+		IotaLogSummary* summary = new IotaLogSummary;
+		while(serial <= endSerial && maxReads--){
+			if(summaryFile && serial % _summaryRecords == 0 &&
+			   serial + _summaryRecords - 1 <= endSerial &&
+			   serial / _summaryRecords < _summaryEntries){
+				summaryFile.seek((serial / _summaryRecords) * sizeof(IotaLogSummary));
+				summaryFile.read(summary, sizeof(IotaLogSummary));
+				if(summary->channel[channel].min < *min) *min = summary->channel[channel].min;
+				if(summary->channel[channel].max > *max) *max = summary->channel[channel].max;
+				prevAccum1 = summary->channel[channel].accum1;
+				prevLogHours = summary->logHours;
+				*startKey = summary->lastKey;
+				serial += _summaryRecords;
+				continue;
+			}
+			readSerial(serial++, logRecord);
+			double elapsedHours = logRecord->logHours - prevLogHours;
+			if(elapsedHours > 0){
+				double value = (logRecord->channel[channel].accum1 - prevAccum1) / elapsedHours;
+				if(value < *min) *min = value;
+				if(value > *max) *max = value;
+			}
+			prevAccum1 = logRecord->channel[channel].accum1;
+			prevLogHours = logRecord->logHours;
+			*startKey = logRecord->UNIXtime;
+		}
+		if(summaryFile) summaryFile.close();
+		delete summary;
+		delete logRecord;
+		if(serial <= endSerial) return 3;
+		return *max < *min ? 1 : 0;
+	}
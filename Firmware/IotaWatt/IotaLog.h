@@ -7,6 +7,7 @@
 #define IotaLog_h
 #include "SPI.h"
 #include "SD.h"
+#include <float.h>
 
 /*******************************************************************************************************
 ********************************************************************************************************
@@ -17,6 +18,28 @@ All entries must be written with increasing keys.
 Entries are read by key value.
 When reading by key, the entry with the requested or next lower key is returned with the requested key.
 
+New logs begin with an IotaLogHeader giving the format version and record size.  Logs written before
+there was a header (version 0) have none, and 256 byte records.  They are still read and extended
+as they are, with any fields beyond the stored record size returned as zero.
+
+The interval between keys is set when the log is created and kept in the header (version 0 is 5).
+A log can also be created with a channel map, in which case only the mapped channels are stored,
+packed one after the other.  Callers always see a full IotaLogRecord, with the others zero.  The
+frequency range (Hz) isn't kept in a packed log, and reads as zero.
+
+Alongside the log (.sum) is a summary of each block of an hour's worth of records: the first and
+last keys, the highest and lowest value (period average) of each channel, and the accumulators at
+the end.  It is added to as records are written, so min/max queries over long periods can read the
+summaries and only touch the records in partial blocks at either end.  If the summary is missing
+or behind (new firmware, or a restart in mid block), updateSummary() catches it up a bit at a time.
+
+write() returns 3 if the record could not be written (card removed or full).  The log can be end()ed
+and begin()ed again once the card is back.  A batch of records can be written with flush false,
+followed by flush(), so the card sees one update instead of one per record.
+
+Fields added to the end of the record (like Hz) are only kept in logs created since.  Older logs
+keep their record size, and read those fields as zero.
+
 ********************************************************************************************************
 ********************************************************************************************************/
 struct IotaLogRecord {
@@ -24,25 +47,75 @@ struct IotaLogRecord {
 			uint32_t serial;				// record number in file
 			double logHours;				// Total hours of monitoring logged to date in this log	
 			struct channels {
-				double accum1;
+				double accum1;				// Net value*hours
 				channels(){accum1 = 0;}
-			} channel[30];
+			} channel[15];
+			struct channels2 {
+				double accum2;				// Power channels: export watt-hours, voltage channels: Hz-hours
+				channels2(){accum2 = 0;}
+			} channel2[15];					// Was unused channel[15-29], so older logs read as no export
+			struct counts {					// Version 1:
+				uint32_t cycles;			// Cumulative cycles sampled (wraps)
+				uint32_t failures;			// Cumulative cycles failed (wraps)
+				counts(){cycles = 0; failures = 0;}
+			} count[15];
+			struct frequencies {			// Lowest and highest frequency measured in the interval,
+				float min;					// zero for none (or a log with shorter records)
+				float max;
+				frequencies(){min = 0; max = 0;}
+			} Hz;
 			IotaLogRecord(){UNIXtime=0; serial=0; logHours=0;};
 		};
 
+#define IOTALOG_MAGIC 0xF10A1060			// Too late to be the UNIXtime of a version 0 first record
+#define IOTALOG_VERSION 1
+#define IOTALOG_V0_RECORD 256				// Record size of headerless logs
+
+struct IotaLogHeader {
+			uint32_t magic;
+			uint16_t version;
+			uint16_t headerSize;			// Records start here
+			uint32_t recordSize;
+			uint32_t interval;				// Seconds between keys
+			uint32_t channelMap;			// Bit per channel stored, zero for all
+			uint32_t reserved[3];
+			IotaLogHeader(){magic=IOTALOG_MAGIC; version=IOTALOG_VERSION; headerSize=sizeof(IotaLogHeader);
+							recordSize=sizeof(IotaLogRecord); interval=5; channelMap=0; memset(reserved, 0, sizeof(reserved));};
+		};
+
+struct IotaLogSummary {
+			uint32_t firstKey;				// First and last key in the block
+			uint32_t lastKey;
+			double logHours;				// logHours at end of block
+			struct summaries {
+				float min;					// Lowest and highest period average in the block
+				float max;
+				double accum1;				// accum1 at end of block
+			} channel[15];
+			IotaLogSummary(){reset();};
+			void reset(){firstKey=0; lastKey=0; logHours=0;
+						 for(int i=0; i<15; i++){channel[i].min=FLT_MAX; channel[i].max=-FLT_MAX; channel[i].accum1=0;}};
+		};
+
 class IotaLog
 {
   public:
   		
-		int begin (char* /* filepath */);
-		int write (IotaLogRecord* /* pointer to record to be written*/);
+		int begin (char* /* filepath */, uint32_t interval = 5, uint32_t channelMap = 0 /* new log only */);
+		int write (IotaLogRecord* /* pointer to record to be written*/, boolean flush = true);
 		int readKey (IotaLogRecord* /* pointer to caller's buffer */);
 		int readNext(IotaLogRecord* /* pointer to caller's buffer */);
 		int end();
+		void flush();
 		boolean isOpen();
 		uint32_t firstKey();
 		uint32_t lastKey();
 		uint32_t fileSize();
+		uint32_t recordSize();
+		uint32_t interval();
+		uint32_t channelMap();
+		uint32_t updateSummary(uint32_t /* max records to summarize */);
+		int minMax(uint32_t* /* startKey */, uint32_t /* endKey */, int /* channel */, double* /* min */, double* /* max */, uint32_t /* maxReads */);
 		int searchReads();
 			
   private:
@@ -53,26 +126,44 @@ struct IotaL1indexEntry {
 		} L1indexEntry;
 		
 	IotaL1indexEntry* _L1indexEntry = &L1indexEntry;
-	IotaL1indexEntry* _L1indexBuffer;
+	IotaL1indexEntry* _L1indexBuffer = nullptr;
 	uint32_t _L1indexBufferPos;
 		
 	File IotaFile;
 	File IotaIndex;
 	
-	IotaLogRecord* record;
+	IotaLogRecord* record = nullptr;
 	IotaLogRecord* _callerRecord;
 	
 	String logPath;
 	String indexPath;
+	String summaryPath;
 	
 	uint32_t _firstKey = 0;
 	uint32_t _lastKey=0;
 	uint32_t _fileSize = 0;
 	uint32_t _entries = 0;
+	uint32_t _headerSize = 0;				// Zero for version 0 logs
+	uint32_t _recordSize = IOTALOG_V0_RECORD;
 	
-	// Posting interval to log. Currently tested only using 5.
+	// Posting interval to log, from the header.
 	
 	uint32_t _interval = 5;
+
+	// Channels stored, and buffer for packing them when not all are.
+
+	uint32_t _channelMap = 0;
+	uint8_t* _packBuffer = nullptr;
+
+	// Summary blocks.  _summarySerial is the next record to be summarized.  If it's the next to be
+	// written, write() does it, otherwise updateSummary() has catching up to do.
+
+	uint32_t _summaryRecords = 720;			// Records per block (an hour)
+	uint32_t _summaryEntries = 0;			// Complete blocks in summary file
+	uint32_t _summarySerial = 0;
+	IotaLogSummary* _summary = nullptr;		// Block in progress
+	double _prevAccum1[15];					// Previous record summarized
+	double _prevLogHours = 0;
 	
 	// Defines the L1 (SDfile), and L2 (array) indices.
 	// L1 entries are an ordered list of the first UNIXtime/serial of each contigeous series in the log, 
@@ -85,7 +176,7 @@ struct IotaL1indexEntry {
 	uint32_t _L2entries = 0;				// Number of entries in 2nd level index
 	uint32_t _L2maxEntries = 128; 			// Maximum 2nd level index entries
 	uint32_t _L1clusterEntries = 1;			// 1st level entries indexed by one 2nd level entry
-	uint32_t* _L2index;						// 2nd level index array pointer
+	uint32_t* _L2index = nullptr;			// 2nd level index array pointer
 	
 	
 
@@ -99,6 +190,12 @@ struct IotaL1indexEntry {
 	uint32_t search(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
 	int buildIndex(void);
 	void readL1index(uint32_t);
+	void readSerial(uint32_t, IotaLogRecord*);
+	uint32_t packedSize(uint32_t);
+	void pack(IotaLogRecord*);
+	void unpack(IotaLogRecord*);
+	void beginSummary();
+	void summarize(IotaLogRecord*);
 	
 };
 
@@ -1,15 +1,86 @@
 #include "IotaScript.h"
 
+static bool isRefChar(char c){return isAlphaNumeric(c) || c == '_';}
+
 Script*   Script::next() {return _next;}
 
 char*     Script::name() {return _name;} 
 
 char*   Script::units(){return _units;}
 
+Script::measures Script::measure(){return _measure;}
+
+bool    Script::logged(){return _log;}
+
+bool    Script::realtime(){return _realtime;}
+
+uint32_t  Script::hash(){return _hash;}
+
+float     Script::deadband(){return _deadband;}
+
+uint32_t  Script::heartbeat(){return _heartbeat;}
+
 size_t    ScriptSet::count() {return _count;}
 
 Script*   ScriptSet::first() {return _listHead;}  
 
+const char* Script::error(){return _error;}
+
+/*****************************************************************************************
+ *  Outputs can refer to others in the same set by name, as $name.  When the set is loaded,
+ *  resolve() finds them.  An output that refers to one that doesn't exist, or to itself
+ *  through others, or to one with an error, has an error and runs as NaN.  Outputs are
+ *  resolved depth first, so those referred to come first (a topological order), and each
+ *  output's hash takes in those of the outputs it refers to, so changing one is a change
+ *  of the outputs that use it.  Then real-time outputs are compiled.
+ *****************************************************************************************/
+void    ScriptSet::resolve(){
+        for(Script* script = _listHead; script; script = script->_next){
+          script->_set = this;
+          if(script->_refCount > 32) script->_error = "refers to too many outputs";
+          for(int i=0; i<script->_refCount; i++){
+            for(Script* ref = _listHead; ref; ref = ref->_next){
+              if(ref->_name && strcmp(ref->_name, script->_refNames[i]) == 0) script->_refs[i] = ref;
+            }
+            if( ! script->_refs[i]) script->_error = "refers to an unknown output";
+          }
+        }
+        for(Script* script = _listHead; script; script = script->_next){
+          if(script->_visit == Script::unvisited) script->resolve();
+        }
+        for(Script* script = _listHead; script; script = script->_next){
+          if(script->_realtime) script->_realtime = ! script->_error && (script->_program || script->compileScript());
+          for(int i=0; i<script->_refCount; i++) delete[] script->_refNames[i];
+          delete[] script->_refNames;
+          script->_refNames = nullptr;
+        }
+}
+
+void    Script::resolve(){
+        _visit = visiting;
+        for(int i=0; i<_refCount; i++){
+          Script* ref = _refs[i];
+          if( ! ref) continue;
+          if(ref->_visit == visiting){
+            _error = "refers to itself";
+            continue;
+          }
+          if(ref->_visit == unvisited) ref->resolve();
+          if(ref->_error && ! _error) _error = "refers to an output with an error";
+          _hash = (_hash ^ ref->_hash) * 16777619UL;
+        }
+        _visit = visited;
+}
+
+void    ScriptSet::memoBegin(){
+        _pass++;
+        _memo = true;
+}
+
+void    ScriptSet::memoEnd(){
+        _memo = false;
+}
+
 void    Script::print() {
         uint8_t* token = _tokens;
         String string = "Script:";
@@ -21,6 +92,9 @@ void    Script::print() {
           if(*token < getInputOp){
             string += String(opChars[*token]);
           }
+          else if(*token & getOutputOp){
+            string += "$" + String(_refs && _refs[*token - getOutputOp] ? _refs[*token - getOutputOp]->_name : "?");
+          }
           else if(*token & getInputOp){
             string += "@" + String(*token - getInputOp);
           }
@@ -41,15 +115,35 @@ bool    Script::encodeScript(const char* script){
         int tokenCount = 0;
         int constCount = 0;
         int consts = constCount;
+        int refCount = 0;
         for(int i=0; i<strlen(script); i++){
           if(script[i] == '#')constCount++;
+          if(script[i] == '$'){
+            refCount++;
+            tokenCount++;
+            while(isRefChar(script[i+1])) i++;
+            continue;
+          }
           if((!isDigit(script[i])) && (script[i] != '.')) tokenCount++;
         }
         _tokens = new uint8_t[tokenCount + 1];
         _constants = new float[constCount];
+        if(refCount){
+          _refNames = new char*[refCount];
+          _refs = new Script*[refCount];
+        }
         int j = 0;      
         for(int i=0; i<tokenCount; i++){
-          if(script[j] == '@'){
+          if(script[j] == '$'){
+            int start = ++j;
+            while(isRefChar(script[j])) j++;
+            _refNames[_refCount] = new char[j - start + 1];
+            memcpy(_refNames[_refCount], script + start, j - start);
+            _refNames[_refCount][j - start] = 0;
+            _refs[_refCount] = nullptr;
+            _tokens[i] = getOutputOp + _refCount++;
+          }
+          else if(script[j] == '@'){
             int n = script[++j] - '0';
             while(isDigit(script[++j])) n = n * 10 + (script[j] - '0');
             _tokens[i] = getInputOp + n;
@@ -71,15 +165,37 @@ bool    Script::encodeScript(const char* script){
           }   
         }
         _tokens[tokenCount] = 0;
+        return true;
 }
 
-double  Script::run(double inputCallback(int)){
-        uint8_t* tokens = _tokens;
-        return runRecursive(&tokens, inputCallback);
-                
+/*****************************************************************************************
+ *  run() - Run the Script, getting the value of each input from inputCallback, which is
+ *  asked for the net, import or export of the input per the Script's measure.  Import and
+ *  export are per input (see measured()).  An output it refers to is run the same way, by
+ *  its own measure, so it has the same value wherever it's used.  Between memoBegin and
+ *  memoEnd of its set, the result is kept and given again to any run with the same
+ *  inputCallback, so an output that several others refer to runs once.  A run for the inputs
+ *  it visits rather than its value (memo false) neither uses nor keeps results.
+ *****************************************************************************************/
+double  Script::run(double inputCallback(int, measures), bool memo){
+        bool memoize = memo && _set && _set->_memo;
+        if(memoize && _memoPass == _set->_pass && _memoCallback == inputCallback){
+          return _memoValue;
+        }
+        double value = NAN;
+        if( ! _error){
+          uint8_t* tokens = _tokens;
+          value = runRecursive(&tokens, inputCallback, memo);
+        }
+        if(memoize){
+          _memoPass = _set->_pass;
+          _memoCallback = inputCallback;
+          _memoValue = value;
+        }
+        return value;
 }
 
-double  Script::runRecursive(uint8_t** tokens, double inputCallback(int)){
+double  Script::runRecursive(uint8_t** tokens, double inputCallback(int, measures), bool memo){
         double result = 0.0;
         double operand = 0.0;
         uint8_t pendingOp = opAdd;
@@ -96,7 +212,7 @@ double  Script::runRecursive(uint8_t** tokens, double inputCallback(int)){
           }       
           else if(*token == opPush){
             token++;
-            operand = runRecursive(&token, inputCallback);
+            operand = runRecursive(&token, inputCallback, memo);
           }
           else if(*token == opPop){ 
             *tokens = token;
@@ -106,15 +222,159 @@ double  Script::runRecursive(uint8_t** tokens, double inputCallback(int)){
             return evaluate(result, pendingOp, operand);
           }
         
-          if(*token & getInputOp){
-            operand = inputCallback(*token % 32);
+          if(*token & getOutputOp){
+            Script* ref = _refs[*token % 32];
+            operand = ref->run(inputCallback, memo);
           }
-          if(*token & getConstOp){
+          else if(*token & getInputOp){
+            operand = inputCallback(*token % 32, _measure);
+          }
+          else if(*token & getConstOp){
             operand = _constants[*token % 32];
           }
         } while(token++);
 }
 
+/*****************************************************************************************
+ *  The compiled Script - for outputs run by samplePower each cycle, where run() with its
+ *  recursion, callback per input and double arithmetic costs too much.
+ *
+ *  compileScript translates the tokens to a postfix program in the same codes (inputs,
+ *  constants, + - * / |, and opZero) ending with opEq, to be run on a small float stack.
+ *  It gives the same result as run() - left to right, no precedence, | the absolute value
+ *  of the operand before it, a missing operand 0 (or 1 for * and /) - but in float.
+ *  Operands that would only add 0 or multiply by 1 are left out.  An output referred to
+ *  is compiled too, and run by the program by its own measure, as with run().  Between
+ *  memoBegin and memoEnd each runs once by its own measure.
+ *  Returns false for a Script it can't translate (two operands in a row, deeper than
+ *  stackSize).
+ *****************************************************************************************/
+bool    Script::compileScript(){
+        int length = 0;
+        while(_tokens[length]) length++;
+        _program = new uint8_t[length * 2 + 2];
+        uint8_t* tokens = _tokens;
+        uint8_t* program = _program;
+        int depth = 0;
+        int maxDepth = 0;
+        if( ! compileGroup(&tokens, &program, &depth, &maxDepth) || *tokens != opEq || maxDepth > stackSize){
+          delete[] _program;
+          _program = nullptr;
+          return false;
+        }
+        *program = opEq;
+        return true;
+}
+
+bool    Script::compileGroup(uint8_t** tokens, uint8_t** program, int* depth, int* maxDepth){
+        bool haveResult = false;          // Result on the stack (else zero)
+        bool haveOperand = false;         // Operand on the stack (else 0 or 1, left out)
+        uint8_t pendingOp = opAdd;
+        uint8_t* token = *tokens;
+        auto emit = [&](uint8_t op, int change){
+          *(*program)++ = op;
+          *depth += change;
+          if(*depth > *maxDepth) *maxDepth = *depth;
+        };
+        auto startOperand = [&](){
+          if(haveOperand) return false;
+          if( ! haveResult && pendingOp != opAdd){
+            emit(opZero, 1);
+            haveResult = true;
+          }
+          haveOperand = true;
+          return true;
+        };
+        auto endOperand = [&](){
+          if(haveOperand){
+            if(haveResult) emit(pendingOp, -1);
+            haveResult = true;
+          }
+          haveOperand = false;
+        };
+        while(true){
+          if(*token >= opAdd && *token <= opDiv){
+            endOperand();
+            pendingOp = *token;
+          }
+          else if(*token == opAbs){
+            if(haveOperand) emit(opAbs, 0);
+          }
+          else if(*token == opPush){
+            if( ! startOperand()) return false;
+            token++;
+            if( ! compileGroup(&token, program, depth, maxDepth)) return false;
+            if(*token != opPop) return false;
+          }
+          else if(*token == opPop || *token == opEq){
+            endOperand();
+            if( ! haveResult) emit(opZero, 1);
+            *tokens = token;
+            return true;
+          }
+          else if(*token & getOutputOp){
+            Script* ref = _refs[*token % 32];
+            if( ! ref->_program && ! ref->compileScript()) return false;
+            if( ! startOperand()) return false;
+            emit(*token, 1);
+          }
+          else if(*token & (getInputOp | getConstOp)){
+            if( ! startOperand()) return false;
+            emit(*token, 1);
+          }
+          token++;
+        }
+}
+
+/*****************************************************************************************
+ *  runCompiled() - Run the compiled Script with its inputs by measure: the net value of
+ *  each input is net[channel], its export exported[channel].
+ *****************************************************************************************/
+float   Script::runCompiled(const float* net, const float* exported, measures measure){
+        bool memo = _set && _set->_memo && measure == _measure;
+        if(memo && _memoPass == _set->_pass && _memoCallback == nullptr){
+          return _memoValue;
+        }
+        float stack[stackSize];
+        float* top = stack - 1;
+        for(uint8_t* op = _program; *op; op++){
+          if(*op & getOutputOp){
+            Script* ref = _refs[*op % 32];
+            *++top = ref->runCompiled(net, exported, ref->_measure);
+          }
+          else if(*op & getInputOp){
+            int channel = *op % 32;
+            *++top = measure == measureNet ? net[channel] :
+                     measure == measureExport ? exported[channel] : net[channel] + exported[channel];
+          }
+          else if(*op & getConstOp) *++top = _constants[*op % 32];
+          else switch (*op) {
+            case opAdd:  top--; *top += top[1]; break;
+            case opSub:  top--; *top -= top[1]; break;
+            case opMult: top--; *top *= top[1]; break;
+            case opDiv:  top--; *top /= top[1]; break;
+            case opAbs:  if(*top < 0) *top = -*top; break;
+            case opZero: *++top = 0; break;
+          }
+        }
+        if(memo){
+          _memoPass = _set->_pass;
+          _memoCallback = nullptr;
+          _memoValue = *top;
+        }
+        return *top;
+}
+
+/*****************************************************************************************
+ *  measured() - The value of an input by measure, from its net and export (positive):
+ *  import is net + export.
+ *****************************************************************************************/
+double  Script::measured(measures measure, double net, double exported){
+        if(measure == measureImport) return net + exported;
+        if(measure == measureExport) return exported;
+        return net;
+}
+
 double    Script::evaluate(double result, uint8_t token, double operand){
         switch (token) {
           case opAdd:
@@ -126,4 +386,12 @@ double    Script::evaluate(double result, uint8_t token, double operand){
           case opDiv:
             return result / operand;    
         }
-}
+}
+
+uint32_t  Script::hashScript(const char* script){
+        uint32_t hash = 2166136261UL;
+        while(*script){
+          hash = (hash ^ (uint8_t)*script++) * 16777619UL;
+        }
+        return hash;
+}
@@ -4,6 +4,8 @@
 #include <Arduino.h>
 #include <ArduinoJson.h>
 
+class ScriptSet;
+
 class Script {
 
   friend class ScriptSet;
@@ -12,6 +14,17 @@ class Script {
 
     Script(JsonObject& JsonScript) {
       _next = NULL;
+      _set = nullptr;
+      _name = nullptr;
+      _units = nullptr;
+      _tokens = nullptr;
+      _constants = nullptr;
+      _refs = nullptr;
+      _refNames = nullptr;
+      _refCount = 0;
+      _error = nullptr;
+      _visit = unvisited;
+      _memoPass = 0;
       JsonVariant var = JsonScript["name"];
       if(var.success()){
         _name = new char[strlen(var.as<char*>())+1];
@@ -22,10 +35,25 @@ class Script {
         _units = new char[strlen(var.as<char*>())+1];
         strcpy(_units, var.as<char*>());
       }
+      _measure = measureNet;
+      var = JsonScript["measure"];
+      if(var.success()){
+        if(strcmp(var.as<char*>(), "import") == 0) _measure = measureImport;
+        else if(strcmp(var.as<char*>(), "export") == 0) _measure = measureExport;
+      }
+      _log = JsonScript["log"].as<bool>();
+      _realtime = JsonScript["realtime"].as<bool>();
+      _program = nullptr;
+      _deadband = JsonScript["deadband"].as<float>();
+      _heartbeat = JsonScript["heartbeat"].as<unsigned int>();
+      _hash = 0;
       var = JsonScript["script"];
       if(var.success()){
         encodeScript(var.as<char*>() );
+        _hash = hashScript(var.as<char*>());
       }
+      else _realtime = false;
+      if(_realtime) _log = true;
     }
 
     ~Script() {
@@ -33,24 +61,59 @@ class Script {
       delete[] _units;
       delete[] _tokens;
       delete[] _constants;
+      delete[] _program;
+      delete[] _refs;
+      if(_refNames) for(int i=0; i<_refCount; i++) delete[] _refNames[i];
+      delete[] _refNames;
     }
 
+    enum    measures {
+            measureNet = 0,
+            measureImport = 1,
+            measureExport = 2};
+
     char*   name();     // name associated with this Script
     char*   units();    // units associated with this Script
+    measures measure(); // net, import or export power of the inputs (and of outputs referred to)
+    bool    logged();   // true if values are kept in the output log
+    bool    realtime(); // true if run each cycle by samplePower (compiled)
+    uint32_t hash();    // hash of the script text, identifies its version in the output log
+    float   deadband(); // uploaders send only changes bigger than this, zero for every value
+    uint32_t heartbeat(); // but at least this often (seconds), zero for no limit
     Script*   next();     // -> next Script in set
+    const char* error();  // why the Script can't be run (outputs it refers to), nullptr if it can
 
-    double    run(double inputCallback(int)); // Run this Script
+    double    run(double inputCallback(int, measures), bool memo = true); // Run this Script
+    float     runCompiled(const float* net, const float* exported, measures measure); // Run the compiled Script
+    static double measured(measures measure, double net, double exported); // net, import or export of an input
     void    print();
 
   private:
 
     Script*     _next;      // -> next in list
+    ScriptSet*  _set;       // -> set it's in
     char*       _name;      // name associated with this Script
     char*       _units;     // units associated with this Script
+    measures    _measure;   // net, import or export
+    bool        _log;       // Keep values in output log
+    bool        _realtime;  // Compiled, run each cycle
+    uint32_t    _hash;      // FNV-1a of script text
+    float       _deadband;  // Change to report
+    uint32_t    _heartbeat; // Longest silence
     uint8_t*    _tokens;    // Script tokens
     float*     _constants;   // Constant values referenced in Script
+    uint8_t*    _program;   // Compiled Script, postfix
+    Script**    _refs;      // Outputs referenced, by getOutputOp token
+    char**      _refNames;  // Their names, until resolved
+    uint8_t     _refCount;
+    const char* _error;     // Set when references can't be resolved
+    enum        {unvisited, visiting, visited} _visit;  // Resolving references
+    uint32_t    _memoPass;  // Pass of the set _memoValue was computed in
+    double      (*_memoCallback)(int, measures);
+    double      _memoValue;
     const byte  getInputOp = 32;
     const byte  getConstOp = 64;
+    const byte  getOutputOp = 128;
     enum        opCodes {
                 opEq  = 0,
                 opAdd   = 1,
@@ -59,12 +122,18 @@ class Script {
                 opDiv   = 4,
                 opAbs   = 5,
                 opPush  = 6,
-                opPop   = 7};
+                opPop   = 7,
+                opZero  = 10};  // Compiled only: push zero
     const char* opChars = "=+-*/|()";
+    static const int stackSize = 8; // Deepest compiled Script
 
-    double    runRecursive(uint8_t**, double inputCallback(int));
+    double    runRecursive(uint8_t**, double inputCallback(int, measures), bool memo);
     double    evaluate(double, byte, double);
     bool      encodeScript(const char* script);
+    bool      compileScript();
+    bool      compileGroup(uint8_t** tokens, uint8_t** program, int* depth, int* maxDepth);
+    void      resolve();
+    uint32_t  hashScript(const char* script);
 
 };
 
@@ -84,6 +153,9 @@ class ScriptSet {
           script = script->_next;
         }
       }
+      _pass = 0;
+      _memo = false;
+      resolve();
     }
 
     ~ScriptSet(){
@@ -96,11 +168,19 @@ class ScriptSet {
 
     size_t    count();      // Retrieve count of Scripts in the set.
     Script*   first();      // Get -> first Script in set
+    void      memoBegin();  // Each Script runs once until memoEnd, results shared by Scripts that refer to it
+    void      memoEnd();
 
   private:
 
+    friend class Script;
+
     size_t    _count;       // The actual count
     Script*   _listHead;      // -> first Script
+    uint32_t  _pass;          // memoBegin count
+    bool      _memo;          // Between memoBegin and memoEnd
+
+    void      resolve();
 
 };
 
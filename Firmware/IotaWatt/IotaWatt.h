@@ -28,7 +28,6 @@
 
 #include <Arduino.h>
 #include <ESP8266WiFi.h>
-#include <WiFiManager.h>
 #include <ESP8266mDNS.h>
 #include <DNSServer.h>
 #include <WiFiClient.h>
@@ -47,6 +46,8 @@
 #include "IotaLog.h"
 #include "IotaInputChannel.h"
 #include "IotaScript.h"
+#include "GzipStream.h"
+#include "EventLog.h"
 
 #include <Crypto.h>
 #include <AES.h>
@@ -62,10 +63,11 @@
       // Declare instances of major classes
 
 extern WiFiClient WifiClient;
-extern WiFiManager wifiManager;
 extern ESP8266WebServer server;
 extern DNSServer dnsServer;
 extern IotaLog iotaLog;
+extern IotaLog fastLog;                     // Subset of channels at a shorter interval
+extern IotaLog outputLog;                   // Values of logged outputs
 extern RTC_PCF8523 rtc;
 extern Ticker ticker;
 extern CBC<AES128> cypher;
@@ -80,9 +82,15 @@ extern MD5Builder md5;
 
 extern String deviceName;
 extern String IotaLogFile;
+extern String fastLogFile;
+extern String outputLogFile;
+extern String outputLogColumnsFile;
 extern String IotaMsgLog;
 extern String EmonPostLogFile;
 extern String influxPostLogFile;
+extern String biasFile;
+extern String pqLogFile;
+extern String loadEventLogFile;
 extern uint16_t deviceVersion;
 
         // Define the hardware pins
@@ -104,6 +112,14 @@ extern uint8_t ADC_selectPin[2];            // indexable reference for ADC selec
 #define QUERY_VOLTAGE  1
 #define QUERY_POWER  2
 #define QUERY_ENERGY 3
+#define QUERY_IMPORT 4
+#define QUERY_EXPORT 5
+#define QUERY_CYCLES 6
+#define QUERY_FAILURES 7
+#define QUERY_FREQUENCY 8                   // Voltage channels: average Hz
+#define QUERY_FREQUENCY_MIN 9               //                   lowest and highest Hz measured
+#define QUERY_FREQUENCY_MAX 0               //                   (any voltage channel, it's one grid)
+#define FREQUENCY_RANGE_RECORDS 720         // Most log records per point for the frequency range
 
      // RTC trace trace module values by module. (See trace routines in Loop tab)
 
@@ -140,6 +156,17 @@ struct serviceBlock {                  // Scheduler/Dispatcher list item (see co
 
 extern serviceBlock* serviceQueue;     // Head of ordered list of services
 
+struct seriesState {                   // Uploader's record of an output series (see seriesFilter)
+  double lastValue;                    // Last value sent
+  uint32_t lastTime;                   // and when, zero for never
+  double heldValue;                    // Last value held back
+  uint32_t heldTime;
+  bool held;                           // Values held back since last sent
+  seriesState(){lastValue=0; lastTime=0; heldValue=0; heldTime=0; held=false;}
+};
+#define SERIES_SEND 1                  // seriesFilter: send this value
+#define SERIES_BOUNDARY 2              // and the held value before it
+
       // Define maximum number of input channels.
       // Create pointer for array of pointers to incidences of input channels
       // Initial values here are defaults for IotaWatt 2.1.
@@ -158,13 +185,16 @@ extern float    VrefVolts;                    // Voltage reference shunt value u
       // statService maintains current averages of the channel values
       // so that current values can be displayed by web clients
       // statService runs at low frequency but is reved up by the web server
-      // handlers if the statistics are used.
+      // handlers if the statistics are used (see statDemand in Loop).
 
 extern float   frequency;                             // Split the difference to start
 extern float   samplesPerCycle;                       // Here as well
 extern float   cycleSampleRate;
 extern int16_t cycleSamples;
+extern uint32_t irregularCycles;                      // Cycles corrected for non-uniform sample intervals
+extern uint32_t rejectedCycles;                       // Cycles rejected for excessive sample gaps
 extern dataBuckets statBucket[MAXINPUTS];
+extern double  statServiceMs;                         // Total time spent maintaining statBucket
 
       // ****************************** list of output channels **********************
 
@@ -178,6 +208,9 @@ extern bool     hasSD;
 extern File     uploadFile;
 extern boolean  serverAvailable;          // Set false when asynchronous handler active to avoid new requests
 extern boolean  wifiConnected;
+extern boolean  wifiPortalActive;         // WiFi provisioning portal (soft AP) is up
+extern uint32_t wifiPortalStartMs;        // millis() when portal started
+extern uint32_t wifiPortalTimeout;        // Seconds to keep portal up when the clock is running
 extern uint8_t  configSHA256[32];         // Hash of config file
 
       // ****************************** Timing and time data *************************
@@ -188,9 +221,44 @@ extern uint32_t timeRefNTP;  // Last time from NTP server (NTPtime)
 extern uint32_t timeRefMs;                     // Internal MS clock corresponding to timeRefNTP
 extern uint32_t timeSynchInterval;           // Interval (sec) to roll NTP forward and try to refresh
 extern uint32_t dataLogInterval;               // Interval (sec) to invoke dataLog
+extern uint32_t fastLogInterval;               // Interval (sec) of fastLog
+extern uint32_t fastLogChannels;               // Bit per channel in fastLog, zero for none
+extern bool     fastLogStarted;                // set true when fastLogService started
+extern bool     outputLogReconcile;            // Outputs (re)configured, match output log columns
+extern bool     outputRebuilding;              // set true when outputRebuildService started
+extern uint32_t logBatchRecords;               // Records per batch from flash journal to log, 0 for none
+extern bool     dataLogDegraded;               // Data log out of action, records going to journal
+extern uint32_t dataLogDegradedSince;          // UNIXtime it went out
+extern IotaLogRecord* dataLogRecord;           // dataLog's latest record (cumulative energy)
+extern bool     modbusEnabled;                 // Modbus TCP server configured
+extern uint16_t modbusPort;                    // and its port
+extern bool     multicastEnabled;              // Multicast readings every statService tick
+extern IPAddress multicastGroup;               // to this group
+extern uint16_t multicastPort;                 // and port
+extern bool     pqEnabled;                     // Power quality events configured
+extern bool     pqStarted;                     // set true when pqService started
+extern uint32_t pqNominal;                     // Reference dV, zero for each VT's moving average
+extern uint32_t pqSagPercent;                  // Thresholds, percent of reference
+extern uint32_t pqSwellPercent;
+extern uint32_t pqInterruptPercent;
+extern uint32_t pqHysteresisPercent;
+extern bool     captureEnabled;                // Waveform capture configured
+extern bool     captureStarted;                // set true when captureService started
+extern uint32_t captureChannels;               // Bit per channel watched
+extern float    captureStepAmps;               // Trigger on an Irms step of this, zero for none
+extern uint32_t captureDipPercent;             // Trigger on a Vrms dip of this, zero for none
+extern uint32_t captureCycles;                 // Cycles in a capture
+extern uint32_t captureRingSize;               // Bytes of capture ring
+extern int      captureHold;                   // Channel being captured, main loop stays on it, -1 none
+extern uint32_t loadEventChannels;             // Bit per channel watched for load events, zero for none
+extern float    loadEventMinWatts;             // Smallest step that's an event
+extern bool     loadEventStarted;              // set true when loadEventService started
+extern int      realtimeOutputs;               // Outputs run each cycle by samplePower
 extern uint32_t EmonCMSInterval;               // Interval (sec) to invoke EmonCMS
 extern uint32_t influxDBInterval;              // Interval (sec) to invoke inflexDB
 extern uint32_t statServiceInterval;           // Interval (sec) to invoke statService
+extern uint32_t statIdleInterval;              // Interval (sec) to invoke statService when nobody is looking
+extern uint32_t statIdleSeconds;               // Seconds without demand before statService idles
 extern uint32_t updaterServiceInterval;     // Interval (sec) to check for software updates
 
 extern bool     hasRTC;
@@ -214,6 +282,8 @@ extern bool     EmonStop;                         // set true to stop the Servic
 extern bool     EmonInitialize;                   // Initialize or reinitialize EmonService
 extern String   EmonURL;                          // These are set from the config file
 extern String   EmonURI;
+extern uint16_t EmonPort;
+extern bool     EmonHTTPS;                        // https:// server
 extern String   apiKey;
 extern uint8_t  cryptoKey[16];
 extern String   node;
@@ -235,9 +305,20 @@ extern bool     influxStop;                       // set true to stop the Servic
 extern bool     influxInitialize;                 // Initialize or reinitialize
 extern String   influxURL;
 extern uint16_t influxPort;
+extern bool     influxHTTPS;                      // https:// server
 extern String   influxDataBase;
 extern int16_t  influxBulkSend;
 extern ScriptSet* influxOutputs;
+extern bool     influxQuality;                    // Add cycles/failures fields to each point
+
+      //********************** Uploader connections (uploadHTTP.cpp) ********************//
+
+extern String   uploadFingerprint;                // SHA1 fingerprint of https server's certificate
+extern uint32_t uploadPosts;                      // Posts made
+extern uint32_t uploadConnects;                   // https posts that needed a new connection
+extern uint32_t uploadLastMs;                     // Time taken by last post
+extern uint32_t uploadMaxMs;
+extern uint32_t uploadTotalMs;
 
       // ************************ ADC sample pairs ************************************
 
@@ -245,6 +326,7 @@ extern ScriptSet* influxOutputs;
 extern int16_t samples;                           // Number of samples taken in last sampling
 extern int16_t Vsample [MAX_SAMPLES];             // voltage/current pairs during sampling
 extern int16_t Isample [MAX_SAMPLES];
+extern uint16_t Tsample [MAX_SAMPLES];            // interval preceeding each pair (cpu cycles / 16)
 
       // ************************ Declare global functions
 void      setup();
@@ -255,14 +337,66 @@ void      logTrace(void);
 void      NewService(uint32_t (*serviceFunction)(struct serviceBlock*));
 void      AddService(struct serviceBlock*);
 uint32_t  dataLog(struct serviceBlock*);
+uint32_t  fastLogService(struct serviceBlock*);
+uint32_t  summaryService(struct serviceBlock*);
+uint32_t  outputRebuildService(struct serviceBlock*);
+void      outputLogWrite(IotaLogRecord*);
+int       outputLogColumn(Script*);
+uint32_t  outputLogSince(int column);
+uint32_t  outputLogOrigin(int column);
+double    outputLogBase(int column);
+uint32_t  logDrainService(struct serviceBlock*);
+boolean   flashJournalBegin();
+int       flashJournalWrite(IotaLogRecord*);
+int       flashJournalDrain(uint32_t maxRecords);
+boolean   flashJournalLast(IotaLogRecord*);
+uint32_t  flashJournalEntries();
+int       admitRequest(uint32_t cost, uint32_t* retryAfter);
+void      admissionCharge(uint32_t ms);
+void      admissionStatus(JsonObject&);
+void      modbusPoll();
+void      modbusStop();
+void      modbusRefresh();
+void      multicastSend();
+void      pqDetect(int channel, float Vrms);
+uint32_t  pqService(struct serviceBlock*);
+void      captureCycle(IotaInputChannel* Ichannel, IotaInputChannel* Vchannel, float Irms, float Vrms, float Vratio, float Iratio);
+void      captureAbort();
+uint32_t  captureService(struct serviceBlock*);
+void      loadEventDetect(int channel, float watts);
+uint32_t  loadEventService(struct serviceBlock*);
+void      realtimeConfigure();
+void      realtimeCycle(int channel, float value, int vchannel = -1, float volts = 0);
+double    realtimeTake(Script*, uint32_t UNIXtime);
+void      realtimeMark(uint32_t UNIXtime);
+void      realtimeStatus(JsonObject&);
+HTTPClient* uploadBegin(const String& host, uint16_t port, const String& uri, bool https);
+void      uploadEnd(HTTPClient&, uint32_t startMs);
+void      journalWrite(IotaLogRecord*);
+IotaLogRecord* journalRecord(uint32_t n);
+void      journalEnd();
+uint32_t  journalEntries();
+uint32_t  journalCapacity();
+uint32_t  journalStride();
+double    scriptValue(Script*, IotaLogRecord*, double* accum1Then, double* accum2Then, double elapsedHours);
+bool      logsExport(int channel);
+int       seriesFilter(Script*, seriesState*, double value, uint32_t time);
+void      scriptCounts(Script*, IotaLogRecord*, uint32_t* cyclesThen, uint32_t* failuresThen, uint32_t* cycles, uint32_t* failures);
 uint32_t  statService(struct serviceBlock*);
+void      statDemand();
+double    statInput(int channel, Script::measures);
 uint32_t  EmonService(struct serviceBlock*);
 uint32_t  influxService(struct serviceBlock*);
 uint32_t  timeSync(struct serviceBlock*);
 uint32_t  updater(struct serviceBlock*);
 uint32_t  WiFiService(struct serviceBlock*);
+uint32_t  biasService(struct serviceBlock*);
 uint32_t  handleGetFeedData(struct serviceBlock*);
 
+void      startWiFiPortal();
+void      stopWiFiPortal();
+bool      wifiPortalRequest();
+
 void      setLedCycle(const char*);
 void      endLedCycle();
 void      ledBlink();
@@ -67,9 +67,10 @@
       // Define instances of major classes to be used
 
 WiFiClient WifiClient;
-WiFiManager wifiManager;
 DNSServer dnsServer;    
 IotaLog iotaLog;                            // instance of IotaLog class
+IotaLog fastLog;                            // Subset of channels at a shorter interval
+IotaLog outputLog;                          // Values of logged outputs
 RTC_PCF8523 rtc;                            // Instance of RTC_PCF8523
 Ticker ticker;
 CBC<AES128> cypher;
@@ -81,9 +82,15 @@ MD5Builder md5;
 
 String deviceName = "IotaWatt";             
 String IotaLogFile = "/IotaWatt/IotaLog";
+String fastLogFile = "/iotawatt/fastlog";
+String outputLogFile = "/iotawatt/outlog";   // + A or B
+String outputLogColumnsFile = "/iotawatt/outlog.txt";
 String IotaMsgLog = "/IotaWatt/IotaMsgs.txt";
 String EmonPostLogFile = "/iotawatt/Emonlog.log";
 String influxPostLogFile = "/iotawatt/influxdb.log";
+String biasFile = "/iotawatt/adcbias.bin";
+String pqLogFile = "/iotawatt/pqevents.bin";
+String loadEventLogFile = "/iotawatt/loadevts.bin";
 
                        
 uint8_t ADC_selectPin[2] = {pin_CS_ADC0,    // indexable reference for ADC select pins
@@ -117,13 +124,16 @@ float     VrefVolts = 2.5;            // Voltage reference shunt value used to c
       // statService maintains current averages of the channel values
       // so that current values can be displayed by web clients
       // statService runs at low frequency but is reved up by the web server 
-      // handlers if the statistics are used.
+      // handlers if the statistics are used (see statDemand in Loop).
 
 float   frequency = 55;                  // Split the difference to start
 float   samplesPerCycle = 550;           // Here as well
 float   cycleSampleRate = 0;
 int16_t cycleSamples = 0;
+uint32_t irregularCycles = 0;
+uint32_t rejectedCycles = 0;
 dataBuckets statBucket[MAXINPUTS];
+double  statServiceMs = 0;
 
       // ****************************** SDWebServer stuff ****************************
 
@@ -134,6 +144,9 @@ bool    hasSD = false;
 File    uploadFile;
 boolean serverAvailable = true;   // Set false when asynchronous handler active to avoid new requests
 boolean wifiConnected = false;
+boolean wifiPortalActive = false; // WiFi provisioning portal (soft AP) is up
+uint32_t wifiPortalStartMs = 0;   // millis() when portal started
+uint32_t wifiPortalTimeout = 180; // Seconds to keep portal up when the clock is running
 uint8_t configSHA256[32];         // Hash of config file last time read or written
 
       // ****************************** Timing and time data *************************
@@ -144,9 +157,44 @@ uint32_t timeRefNTP = SEVENTY_YEAR_SECONDS;  // Last time from NTP server (NTPti
 uint32_t timeRefMs = 0;                      // Internal MS clock corresponding to timeRefNTP
 uint32_t timeSynchInterval = 3600;           // Interval (sec) to roll NTP forward and try to refresh
 uint32_t dataLogInterval = 5;                // Interval (sec) to invoke dataLog
+uint32_t fastLogInterval = 1;                // Interval (sec) of fastLog
+uint32_t fastLogChannels = 0;                // Bit per channel in fastLog, zero for none
+bool     fastLogStarted = false;             // set true when fastLogService started
+bool     outputLogReconcile = true;          // Outputs (re)configured, match output log columns
+bool     outputRebuilding = false;           // set true when outputRebuildService started
+uint32_t logBatchRecords = 12;               // Records per batch from flash journal to log, 0 for none
+bool     dataLogDegraded = false;            // Data log out of action, records going to journal
+uint32_t dataLogDegradedSince = 0;           // UNIXtime it went out
+IotaLogRecord* dataLogRecord = nullptr;      // dataLog's latest record (cumulative energy)
+bool     modbusEnabled = false;              // Modbus TCP server configured
+uint16_t modbusPort = 502;                   // and its port
+bool     multicastEnabled = false;           // Multicast readings every statService tick
+IPAddress multicastGroup(239,255,73,1);      // to this group
+uint16_t multicastPort = 7377;               // and port
+bool     pqEnabled = false;                  // Power quality events configured
+bool     pqStarted = false;                  // set true when pqService started
+uint32_t pqNominal = 0;                      // Reference dV, zero for each VT's moving average
+uint32_t pqSagPercent = 90;                  // Thresholds, percent of reference
+uint32_t pqSwellPercent = 110;
+uint32_t pqInterruptPercent = 10;
+uint32_t pqHysteresisPercent = 2;
+bool     captureEnabled = false;             // Waveform capture configured
+bool     captureStarted = false;             // set true when captureService started
+uint32_t captureChannels = 0;                // Bit per channel watched
+float    captureStepAmps = 0;                // Trigger on an Irms step of this, zero for none
+uint32_t captureDipPercent = 0;              // Trigger on a Vrms dip of this, zero for none
+uint32_t captureCycles = 3;                  // Cycles in a capture
+uint32_t captureRingSize = 8192;             // Bytes of capture ring
+int      captureHold = -1;                   // Channel being captured, main loop stays on it, -1 none
+uint32_t loadEventChannels = 0;              // Bit per channel watched for load events, zero for none
+float    loadEventMinWatts = 30;             // Smallest step that's an event
+bool     loadEventStarted = false;           // set true when loadEventService started
+int      realtimeOutputs = 0;                // Outputs run each cycle by samplePower
 uint32_t EmonCMSInterval = 10;               // Interval (sec) to invoke EmonCMS
 uint32_t influxDBInterval = 10;              // Interval (sec) to invoke inflexDB 
 uint32_t statServiceInterval = 1;            // Interval (sec) to invoke statService
+uint32_t statIdleInterval = 30;              // Interval (sec) to invoke statService when nobody is looking
+uint32_t statIdleSeconds = 10;               // Seconds without demand before statService idles
 uint32_t updaterServiceInterval = 60*60;     // Interval (sec) to check for software updates 
 
 bool     hasRTC = false;
@@ -174,6 +222,8 @@ bool      EmonStop = false;                       // set true to stop the Servic
 bool      EmonInitialize = true;                  // Initialize or reinitialize EmonService                                         
 String    EmonURL;                                // These are set from the config file 
 String    EmonURI = "";
+uint16_t  EmonPort = 80;
+bool      EmonHTTPS = false;                      // https:// server
 String    apiKey;
 uint8_t   cryptoKey[16];
 String    node = "IotaWatt";
@@ -191,15 +241,27 @@ bool      influxStop = false;                       // set true to stop the Serv
 bool      influxInitialize = true;                  // Initialize or reinitialize 
 String    influxURL = "167.114.114.94";
 uint16_t  influxPort = 8086;
+bool      influxHTTPS = false;                      // https:// server
 String    influxDataBase = "test";
 int16_t   influxBulkSend = 1;
 ScriptSet* influxOutputs;      
+bool      influxQuality = false;                    // Add cycles/failures fields to each point
+
+      //********************** Uploader connections (uploadHTTP.cpp) ********************//
+
+String    uploadFingerprint = "";                   // SHA1 fingerprint of https server's certificate
+uint32_t  uploadPosts = 0;                          // Posts made
+uint32_t  uploadConnects = 0;                       // https posts that needed a new connection
+uint32_t  uploadLastMs = 0;                         // Time taken by last post
+uint32_t  uploadMaxMs = 0;
+uint32_t  uploadTotalMs = 0;
 
       // ************************ ADC sample pairs ************************************
  
 int16_t   samples = 0;                              // Number of samples taken in last sampling
 int16_t   Vsample [MAX_SAMPLES];                    // voltage/current pairs during sampling
 int16_t   Isample [MAX_SAMPLES];
+uint16_t  Tsample [MAX_SAMPLES];                    // interval preceeding each pair (cpu cycles / 16)
 
 
 
@@ -21,8 +21,13 @@ void loop()
     samplePower(nextChannel, 0);
     trace(T_LOOP,2);
     nextCrossMs = lastCrossMs + 490 / int(frequency);
-    while( ! inputChannel[++nextChannel % maxInputs]);
-    nextChannel = nextChannel % maxInputs;
+    if(captureHold >= 0){                                   // Capturing cycles of a channel
+      nextChannel = captureHold;
+    }
+    else {
+      while( ! inputChannel[++nextChannel % maxInputs]);
+      nextChannel = nextChannel % maxInputs;
+    }
   }
 
   // --------- Give web server a shout out.
@@ -37,6 +42,12 @@ void loop()
     trace(T_LOOP,4);
     yield();
   }
+  if(wifiPortalActive){
+    dnsServer.processNextRequest();
+  }
+  if(modbusEnabled){
+    modbusPoll();
+  }
   
 
 // ---------- If the head of the service queue is dispatchable
@@ -139,12 +150,22 @@ void AddService(struct serviceBlock* newBlock){
  * purposes, and have no global scope to share with others. This simple service maintains periodic
  * values for each of the buckets in a global set of buckets called statBucket.  It also is where 
  * status statistics like sample rates are maintained.  
+ * 
+ * The statistics are only of interest when somebody is looking at them, so they are maintained 
+ * lazily.  Consumers (the /status handler) call statDemand() before using statBucket.  That notes the
+ * demand and, if the buckets are stale, brings them up to date on the spot.  While there is demand, 
+ * statService runs every statServiceInterval seconds to keep the damped averages smooth.  When nobody 
+ * has asked for statIdleSeconds, it drops back to statIdleInterval.  The sampling side is untouched - 
+ * the channel accumulators are always current, so no information is lost by waiting.
+ * Multicast (multicast.cpp) is standing demand - it sends statBucket after every update.
  *******************************************************************************************************/
 
+static uint32_t statTimeThen = 0;             // millis() when statBucket last updated
+static uint32_t statLastDemand = 0;           // millis() when statistics last asked for
+static void statUpdate(uint32_t timeNow);
+
 uint32_t statService(struct serviceBlock* _serviceBlock) { 
-  static uint32_t timeThen = millis();        
   static boolean started = false;
-  static float damping = .5;
   uint32_t timeNow = millis();
 
   if(!started){
@@ -154,10 +175,47 @@ uint32_t statService(struct serviceBlock* _serviceBlock) {
       statBucket[i].accum1 = inputChannel[i]->dataBucket.accum1;
       statBucket[i].accum2 = inputChannel[i]->dataBucket.accum2;
     }
+    statTimeThen = timeNow;
     return (uint32_t)UNIXtime() + 1;
   }
   
-  double elapsedHrs = double((uint32_t)(timeNow - timeThen)) / MS_PER_HOUR;
+  statUpdate(timeNow);
+  if(multicastEnabled){
+    multicastSend();
+    return ((uint32_t)UNIXtime() + statServiceInterval);
+  }
+  if((uint32_t)(timeNow - statLastDemand) < (statIdleSeconds * 1000UL)){
+    return ((uint32_t)UNIXtime() + statServiceInterval);
+  }
+  return ((uint32_t)UNIXtime() + statIdleInterval);
+}
+
+void statDemand(){
+  uint32_t timeNow = millis();
+  statLastDemand = timeNow;
+  if(statTimeThen != 0 && (uint32_t)(timeNow - statTimeThen) >= (statServiceInterval * 1000UL)){
+    statUpdate(timeNow);
+  }
+}
+
+        // Input values for output Scripts run over statBucket.
+        // The averages are net, so export is the negative part.
+
+double statInput(int channel, Script::measures measure){
+  double value = statBucket[channel].value1;
+  return Script::measured(measure, value, value < 0 ? -value : 0);
+}
+
+        // Bring statBucket up to date.
+        // If it's been more than a couple of regular intervals since the last update 
+        // (the service was idling), start fresh with the undamped average for the period.
+
+static void statUpdate(uint32_t timeNow){
+  uint32_t startUs = micros();
+  float damping = .5;
+  if((uint32_t)(timeNow - statTimeThen) > (2000UL * statServiceInterval)) damping = 0;
+  double elapsedHrs = double((uint32_t)(timeNow - statTimeThen)) / MS_PER_HOUR;
+  if(elapsedHrs == 0) return;
   for(int i=0; i<maxInputs; i++){
     inputChannel[i]->ageBuckets(timeNow); 
     statBucket[i].value1 = (damping * statBucket[i].value1) + ((1.0 - damping) * (inputChannel[i]->dataBucket.accum1 - statBucket[i].accum1) / elapsedHrs);
@@ -166,11 +224,11 @@ uint32_t statService(struct serviceBlock* _serviceBlock) {
     statBucket[i].accum2 = inputChannel[i]->dataBucket.accum2;
   }
   
-  cycleSampleRate = damping * cycleSampleRate + (1.0 - damping) * float(cycleSamples * 1000) / float((uint32_t)(timeNow - timeThen));
+  cycleSampleRate = damping * cycleSampleRate + (1.0 - damping) * float(cycleSamples * 1000) / float((uint32_t)(timeNow - statTimeThen));
   cycleSamples = 0;
-  timeThen = timeNow;
-  
-  return ((uint32_t)UNIXtime() + statServiceInterval);
+  statTimeThen = timeNow;
+  if(modbusEnabled) modbusRefresh();
+  statServiceMs += (uint32_t)(micros() - startUs) / 1000.0;
 }
 
 /************************************************************************************************
@@ -8,6 +8,8 @@ void setLedCycle(const char* pattern);
 void endLedCycle();
 void ledBlink();
 void setLedState();
+static void bootPhase(const char* phase);
+static String bootPhases = "";              // Startup phase timings
 
 void setup()
 {
@@ -17,6 +19,7 @@ void setup()
   delay(250);
   Serial.println(F("\r\n\n\n** Restart **\r\n\n"));
   Serial.println(F("Serial Initialized"));
+  bootPhase("serial");
   
   //*************************************** Start SPI *************************************************
     
@@ -49,6 +52,7 @@ void setup()
   }
   msgLog(F("SD initialized."));
   hasSD = true;
+  bootPhase("SD");
 
   //*************************************** Check RTC   *****************************
 
@@ -87,12 +91,14 @@ void setup()
   Wire.write((byte)0);
   Wire.write((byte)0x80);
   Wire.endTransmission();
+  bootPhase("RTC");
 
   //**************************************** Display software version *********************************
 
   msgLog("Version: ", IOTAWATT_VERSION);
 
   copyUpdate(String(IOTAWATT_VERSION));
+  bootPhase("copyUpdate");
   
   //**************************************** Display the trace ****************************************
 
@@ -109,55 +115,20 @@ void setup()
   String msg = "device name: " + deviceName + ", version: " + String(deviceVersion); 
   msgLog(msg);
   msgLog("Local time zone: ",String(localTimeDiff));
+  restoreBias();
+  bootPhase("config");
 
 //*************************************** Start the WiFi  connection *****************************
+//  
+//  Just get it going.  Everything that depends on the network - update check, NTP, MDNS - 
+//  is handled by SERVICEs once it connects, so sampling and logging can start right away.
+//  WiFiService will open the provisioning portal if the connection doesn't come up.
   
   WiFi.setAutoConnect(true);
   WiFi.hostname(host);
   WiFi.begin();
-  uint32_t autoConnectTimeout = millis() + 3000UL;
-  while(WiFi.status() != WL_CONNECTED){
-    if(millis() > autoConnectTimeout){
-      setLedCycle("R.G.G...");
-      wifiManager.setDebugOutput(false);
-      wifiManager.setConfigPortalTimeout(180);
-      String ssid = "iota" + String(ESP.getChipId());
-      String pwd = deviceName;
-      msgLog(F("Connecting with WiFiManager."));
-
-      wifiManager.autoConnect(ssid.c_str(), pwd.c_str());
-      endLedCycle();
-      while(WiFi.status() != WL_CONNECTED && RTCrunning == false){
-        msgLog(F("RTC not running, waiting for WiFi."));
-        setLedCycle("R.R.G...");
-        wifiManager.setConfigPortalTimeout(3600);
-        wifiManager.autoConnect(ssid.c_str(), pwd.c_str());
-        endLedCycle();
-      }
-      break;
-    }
-    yield();
-  }
-  if(WiFi.status() != WL_CONNECTED){
-    msgLog(F("No WiFi connection."));
-  }
-
-  //**************************************** Check for pending update ********************************
-
-  if(checkUpdate()){
-    msgLog(F("Firmware updated, restarting"));
-    delay(500);
-    ESP.restart();
-  }  
-    
-  //*************************************** Start the local DNS service ****************************
+  bootPhase("WiFi");
 
-  if (MDNS.begin(host.c_str())) {
-      MDNS.addService("http", "tcp", 80);
-      msgLog(F("MDNS responder started"));
-      msgLog(String("You can now connect to http://" + String(host) + ".local"));
-  }
-   
  //*************************************** Start the web server ****************************
 
   server.on("/status",HTTP_GET, handleStatus);
@@ -168,13 +139,22 @@ void setup()
   server.on("/edit", HTTP_DELETE, handleDelete);
   server.on("/edit", HTTP_PUT, handleCreate);
   server.on("/edit", HTTP_POST, returnOK, handleFileUpload);
+  server.on("/wifi", HTTP_GET, handleWiFiPortal);
+  server.on("/wifisave", HTTP_POST, handleWiFiSave);
+  server.on("/pq/events", HTTP_GET, handlePQEvents);
+  server.on("/capture/list", HTTP_GET, handleCaptureList);
+  server.on("/capture/data", HTTP_GET, handleCaptureData);
+  server.on("/loadevents", HTTP_GET, handleLoadEvents);
   server.onNotFound(handleNotFound);
+  const char* headerKeys[] = {"Accept-Encoding"};
+  server.collectHeaders(headerKeys, 1);
 
   SdFile::dateTimeCallback(dateTime);
 
   server.begin();
   msgLog(F("HTTP server started"));
   WiFi.mode(WIFI_STA);
+  bootPhase("server");
   
 
  //*************************************** Start the logging services *********************************
@@ -184,12 +164,25 @@ void setup()
   NewService(timeSync);
   NewService(WiFiService);
   NewService(updater);
-  
+  NewService(biasService);
+  bootPhase("services");
+  msgLog("Boot phases (ms): ", bootPhases);
   
 }  // setup()
 /***************************************** End of Setup **********************************************/
 
 
+/*****************************************************************************************************
+ * bootPhase() - Note the time taken by a startup phase.  The list is logged at the end of setup.
+ ****************************************************************************************************/
+
+static void bootPhase(const char* phase){
+  static uint32_t phaseStartMs = 0;
+  uint32_t timeNow = millis();
+  bootPhases += String(phase) + ':' + String(timeNow - phaseStartMs) + ' ';
+  phaseStartMs = timeNow;
+}
+
 String formatHex(uint32_t data){
   const char* hexDigits = "0123456789ABCDEF";
   String str = "00000000";
@@ -210,7 +203,10 @@ void dropDead(const char* pattern){
   }  
 }
 
+static boolean ledCycling = false;          // Ticker is running a pattern, leave the LEDs alone
+
 void setLedCycle(const char* pattern){
+  ledCycling = true;
   ledCount = 0;
   for(int i=0; i<13; i++){
     ledColor[i] = pattern[i];
@@ -221,6 +217,7 @@ void setLedCycle(const char* pattern){
 
 void endLedCycle(){
   ticker.detach();
+  ledCycling = false;
   setLedState();
 }
 
@@ -234,6 +231,7 @@ void ledBlink(){
 }
 
 void setLedState(){
+  if(ledCycling) return;
   digitalWrite(greenLed, HIGH);
   digitalWrite(redLed, LOW);
   if( !RTCrunning || WiFi.status() != WL_CONNECTED){
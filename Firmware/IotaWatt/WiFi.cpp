@@ -1,15 +1,35 @@
 #include "IotaWatt.h"
 
+/*****************************************************************************************************
+ * WiFiService - Keep track of the WiFi connection and run down the provisioning portal.
+ *
+ * Setup just starts the connection and moves on.  If it isn't up within a few seconds, this service
+ * opens the portal (see below), and closes it once the station connects, or after wifiPortalTimeout
+ * seconds if the clock is running.  Without a clock there is no logging anyway, so the portal stays
+ * open until somebody provides credentials or the old ones start working again.
+ * 
+ * The MDNS responder is started here the first time the connection comes up.
+ ****************************************************************************************************/
+
 uint32_t WiFiService(struct serviceBlock* _serviceBlock) {
-  const byte DNS_PORT = 53;
-  IPAddress apIP(192, 168, 4, 1);
-  
+  static uint32_t portalDeadline = millis() + 3000UL;     // Open portal if not connected by then
+  static boolean MDNSstarted = false;
+
   if(WiFi.status() == WL_CONNECTED){
     if(!wifiConnected){
       wifiConnected = true;
       String msg = "WiFi connected. SSID: " + WiFi.SSID() + ", IP: " + WiFi.localIP().toString();
       msgLog(msg);
     }
+    portalDeadline = 0;
+    if( ! MDNSstarted){
+      MDNSstarted = true;
+      if (MDNS.begin(host.c_str())) {
+        MDNS.addService("http", "tcp", 80);
+        msgLog(F("MDNS responder started"));
+        msgLog(String("You can now connect to http://" + String(host) + ".local"));
+      }
+    }
   }
   else {
     if(wifiConnected){
@@ -17,10 +37,122 @@ uint32_t WiFiService(struct serviceBlock* _serviceBlock) {
       msgLog(F("WiFi disconnected."));
     }
   }
-  return UNIXtime() + 1;  
+
+  if(portalDeadline && millis() > portalDeadline){
+    portalDeadline = 0;
+    msgLog(F("No WiFi connection."));
+    startWiFiPortal();
+  }
+
+  if(wifiPortalActive){
+    if(wifiConnected ||
+      (RTCrunning && (uint32_t)(millis() - wifiPortalStartMs) > (wifiPortalTimeout * 1000UL))){
+      stopWiFiPortal();
+    }
+  }
+  return UNIXtime() + 1;
 }
 
 void handleDisconnect(){
   returnOK();
   WiFi.disconnect();
-} 
+}
+
+/*****************************************************************************************************
+ * WiFi provisioning portal.
+ *
+ * This used to be WiFiManager's autoConnect, which runs its own server loop and doesn't return
+ * until it's done - up to an hour with no sampling or logging at all.  Instead, we bring up the soft
+ * AP and a catch-all DNS alongside the station, and serve the credentials page from our own web
+ * server.  Loop keeps sampling, and runs the DNS while the portal is active.
+ *
+ * The AP is "iota" + chipID with the device name as password, same as before.  Any request that
+ * comes in through the AP for something we don't have is redirected to /wifi, which is what phones
+ * and laptops look for to pop up the sign-in page.
+ ****************************************************************************************************/
+
+static const char portalHead[] PROGMEM =
+  "<!DOCTYPE html><html><head><meta name=\"viewport\" content=\"width=device-width,initial-scale=1\">"
+  "<title>IotaWatt WiFi</title></head><body><h3>IotaWatt WiFi setup</h3>"
+  "<form method=\"post\" action=\"/wifisave\">SSID:<br><input name=\"ssid\" list=\"nets\"><datalist id=\"nets\">";
+static const char portalTail[] PROGMEM =
+  "</datalist><br>Password:<br><input name=\"pwd\" type=\"password\"><br><br>"
+  "<input type=\"submit\" value=\"Connect\"></form></body></html>";
+
+void startWiFiPortal(){
+  const byte DNS_PORT = 53;
+  IPAddress apIP(192, 168, 4, 1);
+  String ssid = "iota" + String(ESP.getChipId());
+  String pwd = deviceName;
+  WiFi.mode(WIFI_AP_STA);
+  WiFi.softAPConfig(apIP, apIP, IPAddress(255, 255, 255, 0));
+  WiFi.softAP(ssid.c_str(), pwd.c_str());
+  dnsServer.start(DNS_PORT, "*", apIP);
+  WiFi.scanNetworks(true);
+  wifiPortalActive = true;
+  wifiPortalStartMs = millis();
+  setLedCycle(RTCrunning ? "R.G.G..." : "R.R.G...");
+  msgLog("WiFi portal started. SSID: ", ssid);
+}
+
+void stopWiFiPortal(){
+  dnsServer.stop();
+  WiFi.scanDelete();
+  WiFi.softAPdisconnect(true);
+  WiFi.mode(WIFI_STA);
+  wifiPortalActive = false;
+  endLedCycle();
+  msgLog("WiFi portal closed. Seconds of sampling recovered: ", (uint32_t)(millis() - wifiPortalStartMs) / 1000);
+}
+
+        // Is the current request coming in through the portal AP?
+
+bool wifiPortalRequest(){
+  return wifiPortalActive && server.client().localIP() == WiFi.softAPIP();
+}
+
+        // Network names are whatever nearby APs broadcast, escape them for the page.
+
+static String htmlEscape(const String& text){
+  String escaped;
+  for(int i=0; i<text.length(); i++){
+    char c = text[i];
+    if(c == '&') escaped += "&amp;";
+    else if(c == '<') escaped += "&lt;";
+    else if(c == '>') escaped += "&gt;";
+    else if(c == '"') escaped += "&quot;";
+    else escaped += c;
+  }
+  return escaped;
+}
+
+void handleWiFiPortal(){
+  trace(T_WEB,21);
+  String page = FPSTR(portalHead);
+  int networks = WiFi.scanComplete();
+  for(int i=0; i<networks; i++){
+    page += "<option value=\"" + htmlEscape(WiFi.SSID(i)) + "\">";
+  }
+  if(networks >= 0){
+    WiFi.scanDelete();
+    WiFi.scanNetworks(true);                      // Refresh for next time
+  }
+  page += FPSTR(portalTail);
+  server.send(200, "text/html", page);
+}
+
+void handleWiFiSave(){
+  trace(T_WEB,22);
+  if( ! server.hasArg("ssid") || server.arg("ssid").length() == 0){
+    server.send(400, "text/plain", "SSID required");
+    return;
+  }
+  server.send(200, "text/plain", "Connecting to " + server.arg("ssid") + ". The portal will close when connected.");
+  msgLog("WiFi portal: connecting to ", server.arg("ssid"));
+  WiFi.begin(server.arg("ssid").c_str(), server.arg("pwd").c_str());
+}
+
+void handleWiFiRedirect(){
+  server.sendHeader("Location", "http://" + WiFi.softAPIP().toString() + "/wifi", true);
+  server.send(302, "text/plain", "");
+}
@@ -0,0 +1,126 @@
+#include "IotaWatt.h"
+
+/***************************************************************************************************
+ *  Admission control for the expensive web requests (/feed/data).
+ *
+ *  The cost of a request is the number of values it asks for (points x feeds).  Each client (by IP
+ *  address) has a bucket of tokens, refilled at ADMIT_RATE a second up to ADMIT_BURST.  A request
+ *  is let in if the bucket isn't empty, and its cost taken out, even if that leaves the bucket in
+ *  debt.  So an occasional big query goes straight through, but a client that keeps asking for
+ *  more than its rate waits its turn.  Refused requests get 429 with a Retry-After of how long
+ *  until the bucket is out of debt.
+ *
+ *  Separately, the time spent serving these requests is tracked over ADMIT_WINDOW.  If it has gone
+ *  over ADMIT_MAX_DUTY percent of the time, everybody gets 503 with a Retry-After until it drops,
+ *  so sampling always gets the rest.
+ *
+ *  /status?admission shows the counts and the clients' buckets.
+ **************************************************************************************************/
+
+#define ADMIT_CLIENTS 8                     // Clients tracked, least recently seen is replaced
+#define ADMIT_RATE 5000                     // Values per second
+#define ADMIT_BURST 200000                  // Bucket size
+#define ADMIT_WINDOW 10000                  // ms over which duty is measured
+#define ADMIT_MAX_DUTY 50                   // Percent of time serving requests
+
+struct admitClient {
+  uint32_t IP;
+  int32_t tokens;
+  uint32_t lastMs;                          // Tokens as of
+  admitClient(){IP = 0; tokens = ADMIT_BURST; lastMs = 0;}
+};
+static admitClient clients[ADMIT_CLIENTS];
+
+static uint32_t windowStart = 0;
+static uint32_t windowBusyMs = 0;
+static uint32_t lastDuty = 0;               // Percent, last complete window
+
+static uint32_t admitted = 0;
+static uint32_t limited = 0;                // 429s
+static uint32_t busy = 0;                   // 503s
+
+static uint32_t duty();
+
+/***************************************************************************************************
+ *  admitRequest() - Decide on a request from the current client costing cost values.
+ *  Returns 0 to go ahead, or the HTTP status to refuse it with, and the seconds to wait.
+ **************************************************************************************************/
+int admitRequest(uint32_t cost, uint32_t* retryAfter){
+  uint32_t now = millis();
+  if(duty() >= ADMIT_MAX_DUTY){
+    busy++;
+    *retryAfter = (ADMIT_WINDOW - (now - windowStart)) / 1000 + 1;
+    return 503;
+  }
+  uint32_t IP = server.client().remoteIP();
+  admitClient* client = nullptr;
+  admitClient* oldest = &clients[0];
+  for(int i=0; i<ADMIT_CLIENTS; i++){
+    if(clients[i].IP == IP) client = &clients[i];
+    if(clients[i].lastMs < oldest->lastMs) oldest = &clients[i];
+  }
+  if( ! client){
+    client = oldest;
+    *client = admitClient();
+    client->IP = IP;
+    client->lastMs = now;
+  }
+  uint32_t refill = (now - client->lastMs) / 1000 * ADMIT_RATE;
+  client->lastMs += (now - client->lastMs) / 1000 * 1000;
+  if(refill > ADMIT_BURST || client->tokens + (int32_t)refill > ADMIT_BURST){
+    client->tokens = ADMIT_BURST;
+  }
+  else {
+    client->tokens += refill;
+  }
+  if(client->tokens <= 0){
+    limited++;
+    *retryAfter = (-client->tokens) / ADMIT_RATE + 1;
+    return 429;
+  }
+  client->tokens -= cost > ADMIT_BURST * 10 ? ADMIT_BURST * 10 : cost;
+  admitted++;
+  return 0;
+}
+
+/***************************************************************************************************
+ *  admissionCharge() - Count ms spent serving admitted requests.
+ **************************************************************************************************/
+void admissionCharge(uint32_t ms){
+  duty();
+  windowBusyMs += ms;
+}
+
+/***************************************************************************************************
+ *  admissionStatus() - Add the state of things to a /status reply.
+ **************************************************************************************************/
+void admissionStatus(JsonObject& admission){
+  admission.set("admitted", admitted);
+  admission.set("limited", limited);
+  admission.set("busy", busy);
+  admission.set("duty", duty());
+  JsonArray& clientArray = admission.createNestedArray("clients");
+  for(int i=0; i<ADMIT_CLIENTS; i++){
+    if(clients[i].IP){
+      JsonObject& client = clientArray.createNestedObject();
+      client.set("ip", IPAddress(clients[i].IP).toString());
+      client.set("tokens", clients[i].tokens);
+    }
+  }
+}
+
+        // duty() - Percent of the time busy, the greater of the last window and this one
+        // so far (as a share of the whole window, so it doesn't jump about early on).
+
+static uint32_t duty(){
+  uint32_t now = millis();
+  uint32_t elapsed = now - windowStart;
+  if(elapsed >= ADMIT_WINDOW){
+    lastDuty = windowBusyMs * 100 / elapsed;
+    windowStart = now;
+    windowBusyMs = 0;
+    elapsed = 0;
+  }
+  uint32_t current = windowBusyMs * 100 / ADMIT_WINDOW;
+  return current > lastDuty ? current : lastDuty;
+}
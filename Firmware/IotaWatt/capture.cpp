@@ -0,0 +1,295 @@
+#include "IotaWatt.h"
+
+/***************************************************************************************************
+ *  Triggered waveform capture.
+ *
+ *  To see what a load turning on, or a breaker tripping, actually looked like.  Enabled with
+ *  "capture":{"channels":[...],"step":<amps>,"dip":<percent>,"cycles":<n>} in the config.
+ *  samplePower hands each cycle of the listed power channels to captureCycle.  If its Irms has
+ *  changed by "step" amps or more from the channel's last cycle, or its VT's Vrms has dropped by
+ *  "dip" percent or more, the samples just taken are copied to the capture ring, and the main loop
+ *  stays on that channel (captureHold) for the next "cycles" - 1 cycles, which are added too.
+ *
+ *  The ring ("ring" bytes, default 8192, rounded down to a power of 2 so the counters can wrap)
+ *  is only allocated when capture is on, and is at least big enough for one capture.  It's made
+ *  smaller if need be to leave CAPTURE_HEAP_RESERVE of heap free, and capture isn't started if
+ *  even one capture won't fit.
+ *  A trigger while another capture is in progress, within CAPTURE_HOLDOFF_MS of the last, or
+ *  without room in the ring for it, is counted and ignored.  captureService writes finished
+ *  captures to the SD card a piece at a time, one file each in /iotawatt/capture, keeping the
+ *  last CAPTURE_FILES.
+ *
+ *  GET /capture/list lists them (JSON), GET /capture/data?id=<id> returns one as it is on the card:
+ *
+ *    Header, little-endian:
+ *      0   uint32  "IWCP"
+ *      4   uint32  Capture id
+ *      8   uint32  Total length, bytes
+ *      12  uint32  UNIXtime
+ *      16  uint8   Power channel, 17 its voltage channel
+ *      18  uint8   Trigger: 1 current step, 2 voltage dip
+ *      19  uint8   Cycles
+ *      20  float   Volts per V sample count
+ *      24  float   Amps per I sample count
+ *      28  uint8   CPU MHz, 29-31 zero
+ *    Then each cycle:
+ *      0   uint32  ms since the first cycle
+ *      4   uint32  Time of the cycle, units of 16 CPU cycles
+ *      8   uint16  Sample pairs, 10 zero
+ *      12  int16   V, I, V, I... (ADC counts less bias)
+ **************************************************************************************************/
+
+#define CAPTURE_HOLDOFF_MS 5000             // Least time from one trigger to the next
+#define CAPTURE_FILES 32                    // Captures kept on the card
+#define CAPTURE_WRITE 1024                  // Bytes written to the card per dispatch
+#define CAPTURE_MAGIC 0x50435749            // "IWCP"
+#define CAPTURE_HEADER 32
+#define CAPTURE_CYCLE_HEADER 12
+#define CAPTURE_MIN_RING 1024
+#define CAPTURE_HEAP_RESERVE 12000          // Heap the ring must leave for everything else
+
+static const char* captureDir = "/iotawatt/capture";
+
+static uint8_t* ring = nullptr;
+static uint32_t ringSize = 0;
+static uint32_t ringIn = 0;                 // Bytes added (wraps), capture in progress starts here
+static uint32_t ringUsed = 0;               // Bytes added to capture in progress
+static uint32_t ringReady = 0;              // Bytes of finished captures (wraps)
+static uint32_t ringOut = 0;                // Bytes written to the card (wraps)
+static uint32_t captureStartMs = 0;
+static uint8_t  captureCycleCount = 0;
+static uint8_t  captureRemaining = 0;
+static uint32_t lastTriggerMs = 0;
+static uint32_t nextId = 0;                 // Zero until the card has been checked
+static uint32_t missed = 0;
+
+static void ringPut(const void* data, uint32_t length);
+static void ringPatch(uint32_t offset, const void* data, uint32_t length);
+static String capturePath(uint32_t id);
+static uint32_t captureLength();
+
+/***************************************************************************************************
+ *  captureCycle() - Look at the cycle just sampled, and trigger or continue a capture.
+ **************************************************************************************************/
+void captureCycle(IotaInputChannel* Ichannel, IotaInputChannel* Vchannel, float Irms, float Vrms, float Vratio, float Iratio){
+  if( ! ring || ! nextId) return;
+  int channel = Ichannel->_channel;
+  if(captureHold < 0){
+    if( ! (captureChannels & (1 << channel))) return;
+    uint8_t trigger = 0;
+    if(Ichannel->cycleCount < 2) return;
+    if(captureStepAmps > 0 && abs(Irms - Ichannel->dataBucket.amps) >= captureStepAmps){
+      trigger = 1;
+    }
+    else if(captureDipPercent > 0 && Vrms * 100 <= Vchannel->dataBucket.volts * (100 - captureDipPercent)){
+      trigger = 2;
+    }
+    if( ! trigger) return;
+    uint32_t timeNow = millis();
+    if(timeNow - lastTriggerMs < CAPTURE_HOLDOFF_MS || ringSize - (ringIn - ringOut) < captureLength()){
+      missed++;
+      return;
+    }
+    lastTriggerMs = timeNow;
+    captureStartMs = timeNow;
+    captureCycleCount = 0;
+    captureRemaining = captureCycles;
+    ringUsed = 0;
+    uint8_t header [CAPTURE_HEADER];
+    memset(header, 0, CAPTURE_HEADER);
+    uint32_t words [4] = {CAPTURE_MAGIC, 0, 0, UNIXtime()};
+    memcpy(header, words, 16);
+    header[16] = channel;
+    header[17] = Ichannel->_vchannel;
+    header[18] = trigger;
+    memcpy(header + 20, &Vratio, 4);
+    memcpy(header + 24, &Iratio, 4);
+    header[28] = ESP.getCpuFreqMHz();
+    ringPut(header, CAPTURE_HEADER);
+    captureHold = channel;
+  }
+  if(channel != captureHold) return;
+
+        // Add this cycle, if there's room.
+
+  if(ringSize - (ringIn + ringUsed - ringOut) < CAPTURE_CYCLE_HEADER + samples * 4){
+    captureRemaining = 0;
+  }
+  else {
+    uint32_t ticks = 0;
+    for(int i=0; i<samples; i++) ticks += Tsample[i];
+    uint32_t cycleHeader [3] = {millis() - captureStartMs, ticks, (uint32_t)samples};
+    ringPut(cycleHeader, CAPTURE_CYCLE_HEADER);
+    for(int i=0; i<samples; i++){
+      ringPut(&Vsample[i], 2);
+      ringPut(&Isample[i], 2);
+    }
+    captureCycleCount++;
+    captureRemaining--;
+  }
+
+        // When that's all of them, fill in the header and hand it to captureService.
+
+  if(captureRemaining == 0){
+    captureHold = -1;
+    if(captureCycleCount){
+      ringPatch(8, &ringUsed, 4);
+      ringPatch(19, &captureCycleCount, 1);
+      ringIn += ringUsed;
+      ringReady = ringIn;
+    }
+    ringUsed = 0;
+  }
+}
+
+/***************************************************************************************************
+ *  captureAbort() - The held channel couldn't be sampled, drop the capture in progress.
+ **************************************************************************************************/
+void captureAbort(){
+  captureHold = -1;
+  ringUsed = 0;
+}
+
+/***************************************************************************************************
+ *  captureService - Allocate the ring, find the last capture id on the card, then write finished
+ *  captures to it, CAPTURE_WRITE bytes at a time.
+ **************************************************************************************************/
+uint32_t captureService(struct serviceBlock* _serviceBlock){
+  static File captureFile;
+  static uint32_t fileRemaining = 0;
+  if( ! ring){
+    if( ! samples) return UNIXtime() + 1;               // Size of a cycle not known yet
+    uint32_t least = CAPTURE_MIN_RING;
+    while(least < captureLength()) least *= 2;          // Holds one capture
+    uint32_t heap = ESP.getFreeHeap();
+    uint32_t room = heap > CAPTURE_HEAP_RESERVE ? heap - CAPTURE_HEAP_RESERVE : 0;
+    ringSize = least;
+    while(ringSize * 2 <= captureRingSize) ringSize *= 2;
+    uint32_t wanted = ringSize;
+    while(ringSize > least && ringSize > room) ringSize /= 2;
+    if(ringSize <= room) ring = new (std::nothrow) uint8_t [ringSize];
+    if( ! ring){
+      msgLog("captureService: not enough heap for a capture, not started. Free heap: ", String(heap) + ", needed: " + String(least));
+      ringSize = 0;
+      captureEnabled = false;
+      captureStarted = false;
+      return 0;
+    }
+    msgLog(F("captureService: started."));
+    if(least > captureRingSize) msgLog("captureService: ring made big enough for a capture: ", ringSize);
+    if(ringSize < wanted) msgLog("captureService: ring reduced to fit the heap: ", ringSize);
+    _serviceBlock->priority = priorityLow;
+  }
+  if( ! nextId){
+    if( ! SD.exists(captureDir)) SD.mkdir(captureDir);
+    uint32_t lastId = 0;
+    for(int n=0; n<CAPTURE_FILES; n++){
+      File file = SD.open(capturePath(n), FILE_READ);
+      uint32_t words [2];
+      if(file && file.read(words, 8) == 8 && words[0] == CAPTURE_MAGIC && words[1] > lastId){
+        lastId = words[1];
+      }
+      if(file) file.close();
+    }
+    nextId = lastId + 1;
+    return 1;
+  }
+  if( ! captureFile){
+    if(ringOut == ringReady) return UNIXtime() + 1;
+    uint32_t length;
+    for(int i=0; i<4; i++) ((uint8_t*)&length)[i] = ring[(ringOut + 8 + i) % ringSize];
+    uint32_t id = nextId++;
+    for(int i=0; i<4; i++) ring[(ringOut + 4 + i) % ringSize] = id >> (i * 8);
+    String path = capturePath(id);
+    SD.remove(path);
+    captureFile = SD.open(path, FILE_WRITE);
+    if( ! captureFile){
+      ringOut += length;
+      return UNIXtime() + 1;
+    }
+    fileRemaining = length;
+  }
+  uint32_t count = fileRemaining < CAPTURE_WRITE ? fileRemaining : CAPTURE_WRITE;
+  uint32_t index = ringOut % ringSize;
+  if(index + count > ringSize) count = ringSize - index;
+  captureFile.write(ring + index, count);
+  ringOut += count;
+  fileRemaining -= count;
+  if(fileRemaining == 0){
+    captureFile.close();
+    captureFile = File();
+  }
+  return 1;
+}
+
+/***************************************************************************************************
+ *  handleCaptureList() - GET /capture/list
+ *  handleCaptureData() - GET /capture/data?id=<id>
+ **************************************************************************************************/
+void handleCaptureList(){
+  DynamicJsonBuffer jsonBuffer;
+  JsonObject& root = jsonBuffer.createObject();
+  JsonArray& captures = root.createNestedArray("captures");
+  uint32_t first = nextId > CAPTURE_FILES ? nextId - CAPTURE_FILES : 1;
+  for(uint32_t id=first; id<nextId; id++){
+    File file = SD.open(capturePath(id), FILE_READ);
+    uint8_t header [CAPTURE_HEADER];
+    if(file && file.read(header, CAPTURE_HEADER) == CAPTURE_HEADER){
+      uint32_t words [4];
+      memcpy(words, header, 16);
+      if(words[0] == CAPTURE_MAGIC && words[1] == id){
+        JsonObject& capture = captures.createNestedObject();
+        capture.set("id", id);
+        capture.set("time", words[3]);
+        capture.set("channel", header[16]);
+        capture.set("name", inputChannel[header[16]]->_name);
+        capture.set("trigger", header[18] == 1 ? "step" : "dip");
+        capture.set("cycles", header[19]);
+        capture.set("size", words[2]);
+      }
+    }
+    if(file) file.close();
+  }
+  root.set("missed", missed);
+  String response;
+  root.printTo(response);
+  sendResponse(200, "application/json", response);
+}
+
+void handleCaptureData(){
+  uint32_t id = server.arg("id").toInt();
+  File file;
+  uint32_t magic[2] = {0, 0};
+  if(id) file = SD.open(capturePath(id), FILE_READ);
+  if(file) file.read(magic, 8);
+  if( ! file || magic[0] != CAPTURE_MAGIC || magic[1] != id){
+    if(file) file.close();
+    server.send(404, "text/plain", "No such capture");
+    return;
+  }
+  file.seek(0);
+  server.streamFile(file, "application/octet-stream");
+  file.close();
+}
+
+static void ringPut(const void* data, uint32_t length){
+  for(uint32_t i=0; i<length; i++){
+    ring[(ringIn + ringUsed++) % ringSize] = ((const uint8_t*)data)[i];
+  }
+}
+
+static void ringPatch(uint32_t offset, const void* data, uint32_t length){
+  for(uint32_t i=0; i<length; i++){
+    ring[(ringIn + offset + i) % ringSize] = ((const uint8_t*)data)[i];
+  }
+}
+
+static String capturePath(uint32_t id){
+  return String(captureDir) + "/" + String(id % CAPTURE_FILES) + ".bin";
+}
+
+        // Most a capture can take in the ring, at the current samples per cycle.
+
+static uint32_t captureLength(){
+  return CAPTURE_HEADER + captureCycles * (CAPTURE_CYCLE_HEADER + samples * 4 + 64);
+}
@@ -4,8 +4,14 @@
  * If there is no file, it will be created.
  * 
  * The log records contain 2 double precision value*hours accumulators for each channel.
- * Currently the two are Volt*Hrs / hz.Hrs for VT channels and
- * Watt*Hrs / Irms*Hrs for CT channels.
+ * Currently the first is Volt*Hrs for VT channels and net Watt*Hrs for CT channels.
+ * The second is export Watt*Hrs for CT channels (import is net + export).  It's split out
+ * by sign in ageBuckets as each cycle is sampled, so power flowing both ways within an
+ * interval doesn't cancel out.
+ * 
+ * Each record also carries cumulative counts of the cycles sampled and failed for each channel,
+ * so the difference between two records shows how well the period between them was covered.
+ * These are only kept in version 1 logs (see IotaLog.h).
  * 
  * Given any two log records, the average volts, hz, watts or Irms for the period between them
  * can be determined, in addition to the basic metric like WattHrs.  Power factor (average) can 
@@ -16,17 +22,40 @@
  * but they are ordered.  It is relatively quick to find any record by key (UNIXtime) and a 
  * readKEY method is provided in the IotaLog class.
  * 
+ * Records normally go to the flash journal (flashJournal.cpp), and logDrainService copies them
+ * to the log in batches.  With "logbatch":0 in the config, or no SPIFFS, they're written directly.
+ * 
+ * If the log can't be opened or written, dataLog doesn't stop.  It goes into degraded mode, keeping
+ * its records in the journal (logJournal.cpp) and trying to reopen the log every minute or so.
+ * When it can, logDrainService writes the journals to the log a batch at a time, and things carry
+ * on.  /status?datalog shows it.
+ * 
  * As with all of the SERVICES, it has a  single function call and is implimented as state machine.
  * Services should try not to execute for more than a few milliseconds at a time.
  **********************************************************************************************/
  #include "IotaWatt.h"
  #define GapFill 600           // Fill in gaps of less than this seconds 
+ #define LogRetry 60           // Seconds between attempts to reopen the log when degraded
+
+static boolean logBased = true;         // logRecord carries on from the log's last record
+static uint32_t logRetryTime = 0;
+static boolean firstLogged = false;     // First record since restart kept
+static boolean drainScheduled = false;  // logDrainService is on its way
+
+static void logDegrade(const char* why, int rtc);
+static void logFirst();
+static boolean logRecover(IotaLogRecord* logRecord);
+static void drainSchedule();
+static int journalDrain(uint32_t maxRecords);
        
  uint32_t dataLog(struct serviceBlock* _serviceBlock){
   enum states {initialize, checkClock, logData};
   static states state = initialize;                                                       
   static IotaLogRecord* logRecord = new IotaLogRecord;
   static double accum1Then [MAXINPUTS];
+  static double accum2Then [MAXINPUTS];
+  static uint32_t cyclesThen [MAXINPUTS];
+  static uint32_t failuresThen [MAXINPUTS];
   static uint32_t timeThen = 0;
   uint32_t timeNow = millis();
   static uint32_t timeNext;
@@ -35,22 +64,40 @@
     case initialize: {
 
       msgLog(F("dataLog: service started."));
+      dataLogRecord = logRecord;
 
       // Initialize the IotaLog class
       
-      if(int rtc = iotaLog.begin((char*)IotaLogFile.c_str())){
-        msgLog("dataLog: Log file open failed. ", String(rtc));
-        dropDead();
+      boolean flashJournal = logBatchRecords && flashJournalBegin();
+      if(int rtc = iotaLog.begin((char*)IotaLogFile.c_str(), dataLogInterval)){
+        iotaLog.end();
+        logBased = flashJournal && flashJournalLast(logRecord);
+        logDegrade("Log file open failed.", rtc);
+        state = checkClock;
+        return 1;
       }
+      dataLogInterval = iotaLog.interval();
+      NewService(summaryService);
 
-      // If it's not a new log, get the last entry.
-      
-      if(iotaLog.firstKey() != 0){
+      // Anything left in the flash journal is written by logDrainService.
+      // Carry on from the newest record, in the journal or else the log.
+
+      if(flashJournal && flashJournalEntries() && flashJournalLast(logRecord)){
+        drainSchedule();
+        msgLog("dataLog: Flash journal records to write: ", flashJournalEntries());
+      }
+      else if(iotaLog.firstKey() != 0){
         logRecord->UNIXtime = iotaLog.lastKey();
         iotaLog.readKey(logRecord);
         
         msgLog("dataLog: Last log entry:", iotaLog.lastKey());
       }
+      if(iotaLog.recordSize() <= IOTALOG_V0_RECORD){
+        msgLog(F("dataLog: Version 0 log, sample counts not recorded."));
+      }
+      else if(iotaLog.recordSize() < sizeof(IotaLogRecord)){
+        msgLog(F("dataLog: Older log, frequency range not recorded."));
+      }
 
       state = checkClock;
 
@@ -67,6 +114,9 @@
         if(_input){
           inputChannel[i]->ageBuckets(timeNow);
           accum1Then[i] = inputChannel[i]->dataBucket.accum1;
+          accum2Then[i] = inputChannel[i]->logAccum2At(timeNow);
+          cyclesThen[i] = inputChannel[i]->cycleCount;
+          failuresThen[i] = inputChannel[i]->cycleFailures;
         }
       }
       timeThen = timeNow;
@@ -96,30 +146,94 @@
       if(UNIXtime() < timeNext) return timeNext;
 
       // If log is up to date, update the entry with latest data.
+      // The accumulators are taken as of the interval boundary (in ms), not as of now,
+      // so that each record covers exactly the span its key says regardless of how late
+      // this service was dispatched.  The bit since the boundary goes in the next record.
           
       if(timeNext == (UNIXtime() - UNIXtime() % dataLogInterval)){
-        double elapsedHrs = double((uint32_t)(timeNow - timeThen)) / MS_PER_HOUR;
+        uint32_t boundaryMs = MillisAtUNIXtime(timeNext);
+        if((uint32_t)(millis() - boundaryMs) > dataLogInterval * 1000UL) boundaryMs = millis();   // Not in the last interval
+        if((int32_t)(boundaryMs - timeThen) < 0) boundaryMs = timeThen;       // timeSync stepped the clock back
+        double elapsedHrs = double((uint32_t)(boundaryMs - timeThen)) / MS_PER_HOUR;
         for(int i=0; i<maxInputs; i++){
           IotaInputChannel* _input = inputChannel[i];
           if(_input){
-            _input->ageBuckets(timeNow);
-            logRecord->channel[i].accum1 += _input->dataBucket.accum1 - accum1Then[i];
+            double accum1 = _input->accum1At(boundaryMs);
+            logRecord->channel[i].accum1 += accum1 - accum1Then[i];
             if(logRecord->channel[i].accum1 != logRecord->channel[i].accum1) logRecord->channel[i].accum1 = 0;
-            accum1Then[i] = _input->dataBucket.accum1;
+            accum1Then[i] = accum1;
+            double accum2 = _input->logAccum2At(boundaryMs);
+            logRecord->channel2[i].accum2 += accum2 - accum2Then[i];
+            if(logRecord->channel2[i].accum2 != logRecord->channel2[i].accum2) logRecord->channel2[i].accum2 = 0;
+            accum2Then[i] = accum2;
+            logRecord->count[i].cycles += _input->cycleCount - cyclesThen[i];
+            logRecord->count[i].failures += _input->cycleFailures - failuresThen[i];
+            cyclesThen[i] = _input->cycleCount;
+            failuresThen[i] = _input->cycleFailures;
           }
           else {
             accum1Then[i] = 0;
+            accum2Then[i] = 0;
           }
         }
-        timeThen = timeNow;
+        timeThen = boundaryMs;
         logRecord->logHours += elapsedHrs;
+        realtimeMark(timeNext);
+
+            // Frequency range over all of the voltage channels (it's one grid).
+
+        logRecord->Hz = IotaLogRecord::frequencies();
+        for(int i=0; i<maxInputs; i++){
+          IotaInputChannel* _input = inputChannel[i];
+          if(_input && _input->_type == channelTypeVoltage && _input->HzMax > 0){
+            if(logRecord->Hz.max == 0 || _input->HzMin < logRecord->Hz.min) logRecord->Hz.min = _input->HzMin;
+            if(_input->HzMax > logRecord->Hz.max) logRecord->Hz.max = _input->HzMax;
+            _input->HzMin = 0;
+            _input->HzMax = 0;
+          }
+        }
+      }
+      else {
+        logRecord->Hz = IotaLogRecord::frequencies();
       }
 
       // set the time and record number and write the entry.
       
       logRecord->UNIXtime = timeNext;
       logRecord->serial++;
-      iotaLog.write(logRecord);
+      if(dataLogDegraded){
+        if( ! logBased || flashJournalWrite(logRecord)){
+          journalWrite(logRecord);
+        }
+        logFirst();
+        if(UNIXtime() >= logRetryTime){
+          logRetryTime = UNIXtime() + LogRetry;
+          logRecover(logRecord);
+        }
+        break;
+      }
+      if( ! journalEntries() && logBatchRecords && flashJournalWrite(logRecord) == 0){
+        logFirst();
+        if(flashJournalEntries() >= logBatchRecords) drainSchedule();
+        break;
+      }
+      if(journalEntries() || flashJournalEntries()){      // Earlier records still to be written, keep the order
+        journalWrite(logRecord);
+        logFirst();
+        drainSchedule();
+        break;
+      }
+      int rtc = iotaLog.write(logRecord);
+      if(rtc == 0){
+        logFirst();
+        outputLogWrite(logRecord);
+      }
+      else if(rtc > 1){
+        iotaLog.end();
+        logDegrade("Log write failed.", rtc);
+        journalWrite(logRecord);
+        logFirst();
+      }
       break;
     }
   }
@@ -130,3 +244,347 @@
   return timeNext;
 }
 
+        // Once a record has been kept (logged or journaled), note how long after restart.
+
+static void logFirst(){
+  if( ! firstLogged){
+    firstLogged = true;
+    msgLog("dataLog: first record, ms after restart: ", millis());
+  }
+}
+
+/**********************************************************************************************
+ * logDegrade() - The log is out of action.  Start journaling.
+ * 
+ * logRecover() - Try to reopen the log and write out the journal.  If the log never opened
+ * (logBased false), the records in hand started from zero, so they are rebased onto the log's
+ * last record first.  The restart gap between the two reads as no usage, as any gap does.
+ **********************************************************************************************/
+static void logDegrade(const char* why, int rtc){
+  msgLog(String("dataLog: ") + why + " Journaling, rtc: " + String(rtc));
+  dataLogDegraded = true;
+  dataLogDegradedSince = UNIXtime();
+  logRetryTime = UNIXtime() + LogRetry;
+}
+
+static boolean logRecover(IotaLogRecord* logRecord){
+  boolean opened = logBased;
+  iotaLog.end();
+  if( ! SD.begin(pin_CS_SDcard)) return false;
+  if(iotaLog.begin((char*)IotaLogFile.c_str(), dataLogInterval)){
+    iotaLog.end();
+    return false;
+  }
+  dataLogInterval = iotaLog.interval();
+  if( ! logBased && iotaLog.lastKey()){
+    IotaLogRecord* base = new IotaLogRecord;
+    base->UNIXtime = iotaLog.lastKey();
+    iotaLog.readKey(base);
+    for(uint32_t n=0; n<=journalEntries(); n++){
+      IotaLogRecord* record = n < journalEntries() ? journalRecord(n) : logRecord;
+      record->logHours += base->logHours;
+      for(int i=0; i<MAXINPUTS; i++){
+        record->channel[i].accum1 += base->channel[i].accum1;
+        record->channel2[i].accum2 += base->channel2[i].accum2;
+        record->count[i].cycles += base->count[i].cycles;
+        record->count[i].failures += base->count[i].failures;
+      }
+    }
+    delete base;
+  }
+  logBased = true;
+  msgLog("dataLog: Log recovered, journal records to write: ", flashJournalEntries() + journalEntries());
+  dataLogDegraded = false;
+  drainSchedule();
+  if( ! opened) NewService(summaryService);
+  return true;
+}
+
+/**********************************************************************************************
+ * logDrainService copies a batch from the flash journal, then from the RAM journal, to the log,
+ * at low priority so it waits for a quiet moment.  A big backlog (after an outage or a restart)
+ * goes a batch per dispatch.  Until both are empty, new records join the journals rather than
+ * going ahead of them.
+ * 
+ * drainSchedule() - Start logDrainService if it isn't already on its way.
+ * journalDrain() - Write up to maxRecords of the RAM journal to the log, and end the journal
+ * when it's all written.  Returns the records still to go, or -1 if the log couldn't be written.
+ **********************************************************************************************/
+uint32_t logDrainService(struct serviceBlock* _serviceBlock){
+  _serviceBlock->priority = priorityLow;
+  if(dataLogDegraded){
+    drainScheduled = false;
+    return 0;
+  }
+  int remaining = flashJournalDrain(32);
+  if(remaining == 0) remaining = journalDrain(32);
+  if(remaining < 0){
+    iotaLog.end();
+    logDegrade("Log write failed.", 3);
+  }
+  if(remaining > 0) return 1;
+  drainScheduled = false;
+  return 0;
+}
+
+static void drainSchedule(){
+  if( ! drainScheduled){
+    drainScheduled = true;
+    NewService(logDrainService);
+  }
+}
+
+static int journalDrain(uint32_t maxRecords){
+  static uint32_t replayed = 0;
+  uint32_t count = 0;
+  uint32_t n = 0;
+  for( ; n<journalEntries() && count<maxRecords; n++){
+    IotaLogRecord* record = journalRecord(n);
+    if(record->UNIXtime <= iotaLog.lastKey()) continue;     // Written by an earlier batch
+    int rtc = iotaLog.write(record);
+    if(rtc > 1) return -1;
+    if(rtc == 0){
+      outputLogWrite(record);
+      replayed++;
+    }
+    count++;
+  }
+  if(n < journalEntries()) return journalEntries() - n;
+  if(journalEntries()){
+    msgLog("dataLog: Journal records written: ", replayed);
+    journalEnd();
+    replayed = 0;
+  }
+  return 0;
+}
+
+/**********************************************************************************************
+ * summaryService keeps the logs' summary blocks caught up when they are behind (see IotaLog.h),
+ * a few records at a time.  Once caught up, IotaLog keeps them current as records are written.
+ **********************************************************************************************/
+uint32_t summaryService(struct serviceBlock* _serviceBlock){
+  static boolean caughtUp = true;
+  _serviceBlock->priority = priorityLow;
+  uint32_t behind = iotaLog.updateSummary(16);
+  if(fastLog.isOpen()){
+    behind += fastLog.updateSummary(16);
+  }
+  if(behind){
+    if(caughtUp) msgLog("Log summary catching up, records: ", behind);
+    caughtUp = false;
+    return 1;
+  }
+  if( ! caughtUp) msgLog(F("Log summary caught up."));
+  caughtUp = true;
+  return UNIXtime() + 60;
+}
+
+/**********************************************************************************************
+ * fastLog is the same SERVICE for a configured subset of the channels at a shorter interval
+ * (usually 1 second), for looking at things like short-cycling equipment that average out at
+ * the regular interval.  Only the configured channels are stored (see IotaLog.h), so a few
+ * channels at 1 second take about the same space as all of them at 5.
+ * 
+ * The log is created with the configured channels and interval.  If either is changed, the old
+ * log can't hold the new records, so it is deleted and a new one started.  The SERVICE stops
+ * when there are no channels configured.
+ **********************************************************************************************/
+uint32_t fastLogService(struct serviceBlock* _serviceBlock){
+  enum states {initialize, checkClock, logData};
+  static states state = initialize;
+  static IotaLogRecord* logRecord = nullptr;
+  static double accum1Then [MAXINPUTS];
+  static double accum2Then [MAXINPUTS];
+  static uint32_t cyclesThen [MAXINPUTS];
+  static uint32_t failuresThen [MAXINPUTS];
+  static uint32_t timeThen = 0;
+  static uint32_t timeNext;
+  uint32_t timeNow = millis();
+
+  if(state != initialize &&
+    (fastLogChannels != fastLog.channelMap() || fastLogInterval != fastLog.interval())){
+    fastLog.end();
+    state = initialize;
+  }
+  if( ! fastLogChannels){
+    msgLog(F("fastLog: stopped."));
+    if(fastLog.isOpen()) fastLog.end();
+    state = initialize;
+    delete logRecord;
+    logRecord = nullptr;
+    fastLogStarted = false;
+    return 0;
+  }
+
+  switch(state){
+
+    case initialize: {
+      if( ! iotaLog.isOpen()){
+        return UNIXtime() + 5;
+      }
+      if(iotaLog.interval() % fastLogInterval){
+        msgLog("fastLog: interval doesn't divide the log interval, using 1. ", String(fastLogInterval));
+        fastLogInterval = 1;
+      }
+      if(int rtc = fastLog.begin((char*)fastLogFile.c_str(), fastLogInterval, fastLogChannels)){
+        msgLog("fastLog: Log file open failed. ", String(rtc));
+        fastLogChannels = 0;
+        return 1;
+      }
+      if(fastLog.channelMap() != fastLogChannels || fastLog.interval() != fastLogInterval){
+        fastLog.end();
+        SD.remove((char*)(fastLogFile + ".log").c_str());
+        SD.remove((char*)(fastLogFile + ".ndx").c_str());
+        msgLog(F("fastLog: Channels or interval changed, new log started."));
+        return 1;
+      }
+      msgLog("fastLog: started. interval: ", String(fastLogInterval) + ", channels: " + formatHex(fastLogChannels));
+      if( ! logRecord) logRecord = new IotaLogRecord;
+      if(fastLog.firstKey() != 0){
+        logRecord->UNIXtime = fastLog.lastKey();
+        fastLog.readKey(logRecord);
+      }
+      _serviceBlock->priority = priorityLow;
+      state = checkClock;
+    }
+
+    case checkClock: {
+      for(int i=0; i<maxInputs; i++){
+        if(fastLogChannels & (1 << i)){
+          accum1Then[i] = inputChannel[i]->accum1At(timeNow);
+          accum2Then[i] = inputChannel[i]->logAccum2At(timeNow);
+          cyclesThen[i] = inputChannel[i]->cycleCount;
+          failuresThen[i] = inputChannel[i]->cycleFailures;
+        }
+      }
+      timeThen = timeNow;
+      if( ! RTCrunning) return UNIXtime() + fastLogInterval;
+      if((UNIXtime() - logRecord->UNIXtime) > GapFill){
+        logRecord->UNIXtime = UNIXtime() - UNIXtime() % fastLogInterval;
+      }
+      timeNext = logRecord->UNIXtime;
+      state = logData;
+      break;
+    }
+
+    case logData: {
+      if(UNIXtime() < timeNext) return timeNext;
+      if(timeNext == (UNIXtime() - UNIXtime() % fastLogInterval)){
+        uint32_t boundaryMs = MillisAtUNIXtime(timeNext);
+        if((uint32_t)(millis() - boundaryMs) > fastLogInterval * 1000UL) boundaryMs = millis();
+        if((int32_t)(boundaryMs - timeThen) < 0) boundaryMs = timeThen;
+        for(int i=0; i<maxInputs; i++){
+          if(fastLogChannels & (1 << i)){
+            IotaInputChannel* _input = inputChannel[i];
+            double accum1 = _input->accum1At(boundaryMs);
+            logRecord->channel[i].accum1 += accum1 - accum1Then[i];
+            if(logRecord->channel[i].accum1 != logRecord->channel[i].accum1) logRecord->channel[i].accum1 = 0;
+            accum1Then[i] = accum1;
+            double accum2 = _input->logAccum2At(boundaryMs);
+            logRecord->channel2[i].accum2 += accum2 - accum2Then[i];
+            if(logRecord->channel2[i].accum2 != logRecord->channel2[i].accum2) logRecord->channel2[i].accum2 = 0;
+            accum2Then[i] = accum2;
+            logRecord->count[i].cycles += _input->cycleCount - cyclesThen[i];
+            logRecord->count[i].failures += _input->cycleFailures - failuresThen[i];
+            cyclesThen[i] = _input->cycleCount;
+            failuresThen[i] = _input->cycleFailures;
+          }
+        }
+        logRecord->logHours += double((uint32_t)(boundaryMs - timeThen)) / MS_PER_HOUR;
+        timeThen = boundaryMs;
+      }
+      logRecord->UNIXtime = timeNext;
+      fastLog.write(logRecord);
+      break;
+    }
+  }
+  timeNext += fastLogInterval;
+  return timeNext;
+}
+
+
+/**********************************************************************************************
+ * scriptValue - Run an uploader's output Script over the interval between a log record and the
+ * caller's saved accumulators, giving net, import or export power per the Script's measure.
+ * Import and export are per input, so a Script that combines inputs yields the sum of their
+ * imports (or exports), not the import of the sum.  An output the Script refers to is valued
+ * the same way, by its own measure (see Script::run).  A voltage channel has no export.
+ **********************************************************************************************/
+double scriptValue(Script* script, IotaLogRecord* logRecord, double* accum1Then, double* accum2Then, double elapsedHours){
+  static IotaLogRecord* _logRecord;
+  static double* _accum1Then;
+  static double* _accum2Then;
+  static double _elapsedHours;
+  _logRecord = logRecord;
+  _accum1Then = accum1Then;
+  _accum2Then = accum2Then;
+  _elapsedHours = elapsedHours;
+  return script->run([](int i, Script::measures measure)->double {
+    return Script::measured(measure, _logRecord->channel[i].accum1 - _accum1Then[i],
+                            logsExport(i) ? _logRecord->channel2[i].accum2 - _accum2Then[i] : 0) / _elapsedHours;});
+}
+
+/**********************************************************************************************
+ * logsExport - Whether a channel's second log accumulator (channel2.accum2) is export.  A voltage
+ * channel keeps Hz-hours there instead.
+ **********************************************************************************************/
+bool logsExport(int channel){
+  return ! inputChannel[channel] || inputChannel[channel]->_type != channelTypeVoltage;
+}
+
+/**********************************************************************************************
+ * scriptCounts - The cycles sampled and failed over the same interval for the inputs an
+ * output Script uses.  The Script's result is the worst of them: the fewest cycles sampled
+ * and the most failed.  It's run without the memo, so the inputs of every output it refers to
+ * are visited even when that output has already run in the pass.
+ **********************************************************************************************/
+void scriptCounts(Script* script, IotaLogRecord* logRecord, uint32_t* cyclesThen, uint32_t* failuresThen, uint32_t* cycles, uint32_t* failures){
+  static IotaLogRecord* _logRecord;
+  static uint32_t* _cyclesThen;
+  static uint32_t* _failuresThen;
+  static uint32_t _cycles;
+  static uint32_t _failures;
+  _logRecord = logRecord;
+  _cyclesThen = cyclesThen;
+  _failuresThen = failuresThen;
+  _cycles = 0xffffffff;
+  _failures = 0;
+  script->run([](int i, Script::measures measure)->double {
+    uint32_t cycles = _logRecord->count[i].cycles - _cyclesThen[i];
+    uint32_t failures = _logRecord->count[i].failures - _failuresThen[i];
+    if(cycles < _cycles) _cycles = cycles;
+    if(failures > _failures) _failures = failures;
+    return 1.0;}, false);
+  *cycles = _cycles == 0xffffffff ? 0 : _cycles;
+  *failures = _failures;
+}
+
+/**********************************************************************************************
+ * seriesFilter - Decide whether an uploader sends a Script's value, per its deadband and
+ * heartbeat.  A value is sent if it differs from the last one sent by more than the deadband,
+ * or the heartbeat has run out since.  Otherwise it's held back.
+ * 
+ * When a value is sent after some were held back, the last one held back is sent too
+ * (SERIES_BOUNDARY, value and time in the state), so the server sees where the flat stretch
+ * ended rather than a ramp across it.  Whatever the server does with the series (integrate it
+ * to energy, graph it), it's out by no more than the deadband at any time.
+ **********************************************************************************************/
+int seriesFilter(Script* script, seriesState* state, double value, uint32_t time){
+  boolean send = state->lastTime == 0 ||
+                 (script->deadband() == 0 && script->heartbeat() == 0) ||
+                 (value != value) != (state->lastValue != state->lastValue) ||
+                 fabs(value - state->lastValue) > script->deadband() ||
+                 (script->heartbeat() && time - state->lastTime >= script->heartbeat());
+  if( ! send){
+    state->held = true;
+    state->heldValue = value;
+    state->heldTime = time;
+    return 0;
+  }
+  int rtc = SERIES_SEND;
+  if(state->held) rtc |= SERIES_BOUNDARY;
+  state->held = false;
+  state->lastValue = value;
+  state->lastTime = time;
+  return rtc;
+}
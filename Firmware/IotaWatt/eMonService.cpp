@@ -1,6 +1,7 @@
 #include "IotaWatt.h"
 
 boolean EmonSendData(uint32_t reqUnixtime, String reqData);
+String emonValue(double value);
 String bin2hex(const uint8_t* in, size_t len);
 String encryptData(String in, const uint8_t* key);
 boolean EmonSendData(uint32_t reqUnixtime, String reqData);
@@ -24,6 +25,7 @@ uint32_t EmonService(struct serviceBlock* _serviceBlock){
   static IotaLogRecord* logRecord = new IotaLogRecord;
   static File EmonPostLog;
   static double accum1Then [MAXINPUTS];
+  static double accum2Then [MAXINPUTS];
   static uint32_t UnixLastPost = UNIXtime();
   static uint32_t UnixNextPost = UNIXtime();
   static double _logHours;
@@ -32,6 +34,8 @@ uint32_t EmonService(struct serviceBlock* _serviceBlock){
   static uint32_t reqUnixtime = 0;
   static int  reqEntries = 0; 
   static uint32_t postTime = millis();
+  static seriesState* series = nullptr;
+  static size_t seriesCount = 0;
   struct SDbuffer {uint32_t data; SDbuffer(){data = 0;}};
   static SDbuffer* buf = new SDbuffer;
           
@@ -100,10 +104,19 @@ uint32_t EmonService(struct serviceBlock* _serviceBlock){
       for(int i=0; i<maxInputs; i++){ 
         accum1Then[i] = logRecord->channel[i].accum1;
         if(accum1Then[i] != accum1Then[i]) accum1Then[i] = 0;
+        accum2Then[i] = logRecord->channel2[i].accum2;
+        if(accum2Then[i] != accum2Then[i]) accum2Then[i] = 0;
       }
       _logHours = logRecord->logHours;
       if(_logHours != _logHours) _logHours = 0;
 
+          // Posts are taken from log records, so the post interval has to be
+          // a multiple of the log interval.
+
+      if(EmonCMSInterval % iotaLog.interval()){
+        EmonCMSInterval += iotaLog.interval() - EmonCMSInterval % iotaLog.interval();
+      }
+
           // Assume that record was posted (not important).
           // Plan to start posting one interval later
       
@@ -115,6 +128,9 @@ uint32_t EmonService(struct serviceBlock* _serviceBlock){
 
       reqData = "";
       reqEntries = 0;
+      delete[] series;
+      series = nullptr;
+      seriesCount = 0;
       state = post;
       _serviceBlock->priority = priorityLow;
       return UnixNextPost;
@@ -162,25 +178,16 @@ uint32_t EmonService(struct serviceBlock* _serviceBlock){
         return UnixNextPost;  
       }
       
-          // If new request, format preamble, otherwise, just tack it on with a comma.
-      
-      if(reqData.length() == 0){
-        reqUnixtime = UnixNextPost;
-        reqData = "time=" + String(reqUnixtime) +  "&data=[";
-      }
-      else {
-        reqData += ',';
-      }
-
-          // Build the request string.
+          // Build the frame's values.
           // values for each channel are (delta value hrs)/(delta log hours) = period value.
           // Update the previous (Then) buckets to the most recent values.
      
       trace(T_Emon,5);
 
-      
-      reqData += '[' + String(UnixNextPost - reqUnixtime) + ",\"" + String(node) + "\",";
-            
+      String frame = "";
+      boolean sending = true;
+      String boundary = "";
+      uint32_t boundaryTime = 0;
       double value1;
       _logHours = logRecord->logHours;
       if( ! emonOutputs){  
@@ -188,44 +195,87 @@ uint32_t EmonService(struct serviceBlock* _serviceBlock){
           IotaInputChannel *_input = inputChannel[i];
           value1 = (logRecord->channel[i].accum1 - accum1Then[i]) / elapsedHours;
           if( ! _input){
-            reqData += "null,";
+            frame += "null,";
           }
           else if(_input->_type == channelTypeVoltage){
-            reqData += String(value1,1) + ',';
+            frame += String(value1,1) + ',';
           }
           else if(_input->_type == channelTypePower){
-            reqData += String(long(value1+0.5)) + ',';
+            frame += String(long(value1+0.5)) + ',';
           }
           else{
-            reqData += String(long(value1+0.5)) + ',';
+            frame += String(long(value1+0.5)) + ',';
           }
         }
       }
       else {
+
+            // Values held back by their deadband are left empty.  If a held back value
+            // needs to be sent as a boundary, it goes in a frame of its own, ahead.
+            // If everything is held back, there's no frame at all.
+
+        if(seriesCount != emonOutputs->count()){
+          delete[] series;
+          seriesCount = emonOutputs->count();
+          series = new seriesState[seriesCount];
+        }
+        sending = false;
         Script* script = emonOutputs->first();
         int index=1;
-        while(script){
-          while(index++ < String(script->name()).toInt()) reqData += ',';
-          value1 = script->run([](int i)->double {return (logRecord->channel[i].accum1 - accum1Then[i]) / elapsedHours;});
-          if(value1 > -1.0 && value1 < 1){
-            reqData += "0,";
+        emonOutputs->memoBegin();
+        for(int n=0; script; n++){
+          while(index++ < String(script->name()).toInt()){
+            frame += ',';
+            boundary += ',';
           }
-          else {
-            reqData += String(value1,1) + ',';
+          value1 = scriptValue(script, logRecord, accum1Then, accum2Then, elapsedHours);
+          int send = seriesFilter(script, &series[n], value1, UnixNextPost);
+          if(send & SERIES_BOUNDARY){
+            boundaryTime = series[n].heldTime;
+            boundary += emonValue(series[n].heldValue);
           }
+          if(send & SERIES_SEND){
+            frame += emonValue(value1);
+            sending = true;
+          }
+          frame += ',';
+          boundary += ',';
           script = script->next();
         }
+        emonOutputs->memoEnd();
       }
       for (int i = 0; i < maxInputs; i++) {  
         accum1Then[i] = logRecord->channel[i].accum1;
+        accum2Then[i] = logRecord->channel2[i].accum2;
+      }
+
+          // If new request, format preamble, otherwise, just tack it on with a comma.
+
+      if(sending || boundaryTime){
+        if(reqData.length() == 0){
+          reqUnixtime = UnixNextPost;
+          reqData = "time=" + String(reqUnixtime) +  "&data=[";
+        }
+        else {
+          reqData += ',';
+        }
+        if(boundaryTime){
+          reqData += '[' + String((int32_t)(boundaryTime - reqUnixtime)) + ",\"" + String(node) + "\"," + boundary;
+          reqData.setCharAt(reqData.length()-1,']');
+          if(sending) reqData += ',';
+        }
+        if(sending){
+          reqData += '[' + String(UnixNextPost - reqUnixtime) + ",\"" + String(node) + "\"," + frame;
+          reqData.setCharAt(reqData.length()-1,']');
+        }
+        reqEntries++;
       }
       trace(T_Emon,6);    
-      reqData.setCharAt(reqData.length()-1,']');
-      reqEntries++;
       UnixLastPost = UnixNextPost;
       UnixNextPost +=  EmonCMSInterval - (UnixNextPost % EmonCMSInterval);
       
-      if ((reqEntries < EmonBulkSend) ||
+      if ((reqEntries == 0) ||
+         (reqEntries < EmonBulkSend) ||
          ((iotaLog.lastKey() > UnixNextPost) &&
          (reqData.length() < 1000))) {
         return UnixNextPost;
@@ -269,11 +319,19 @@ uint32_t EmonService(struct serviceBlock* _serviceBlock){
   return 1;
 }
 
+/************************************************************************************************
+ *  emonValue - An output value as it's sent to EmonCMS.
+ ***********************************************************************************************/
+String emonValue(double value){
+  if(value > -1.0 && value < 1){
+    return "0";
+  }
+  return String(value,1);
+}
+
 /************************************************************************************************
  *  EmonSend - send data to the EmonCMS server. 
- *  if secure transmission is configured, pas sthe request to a 
- *  similar WiFiClientSecure function.
- *  Secure takes about twice as long and can block sampling for more than a second.
+ *  An https:// server is posted over a connection kept open between posts (see uploadHTTP.cpp).
  ***********************************************************************************************/
 boolean EmonSendData(uint32_t reqUnixtime, String reqData){ 
   trace(T_Emon,8);
@@ -282,16 +340,18 @@ boolean EmonSendData(uint32_t reqUnixtime, String reqData){
   
   if(EmonSend == EmonSendGET){
     String URL = EmonURI + "/input/bulk.json?" + reqData + "&apikey=" + apiKey;
-    http.begin(EmonURL, 80, URL);
-    http.setTimeout(500);
-    int httpCode = http.GET();
+    HTTPClient* httpClient = uploadBegin(EmonURL, EmonPort, URL, EmonHTTPS);
+    if( ! httpClient) return false;
+    HTTPClient& client = *httpClient;
+    client.setTimeout(500);
+    int httpCode = client.GET();
     if(httpCode != HTTP_CODE_OK){
-      msgLog("EmonService: GET failed. HTTP code: ", http.errorToString(httpCode));
-      http.end();
+      msgLog("EmonService: GET failed. HTTP code: ", client.errorToString(httpCode));
+      uploadEnd(client, startTime);
       return false;
     }
-    String response = http.getString();
-    http.end();
+    String response = client.getString();
+    uploadEnd(client, startTime);
     if(response.startsWith("ok")){
       return true;        
     }
@@ -312,28 +372,30 @@ boolean EmonSendData(uint32_t reqUnixtime, String reqData){
     sha256.finalizeHMAC(cryptoKey, 16, value, 32);
     String hmac = bin2hex(value, 32);
     String auth = EmonUsername + ':' + hmac;
-    http.begin(EmonURL, 80, URI);
-    http.addHeader("Host",EmonURL);
+    HTTPClient* httpClient = uploadBegin(EmonURL, EmonPort, URI, EmonHTTPS);
+    if( ! httpClient) return false;
+    HTTPClient& client = *httpClient;
+    client.addHeader("Host",EmonURL);
     
-    http.addHeader("Content-Type","aes128cbc");
-    http.addHeader("Authorization", auth.c_str());
-    http.setTimeout(500);
-    int httpCode = http.POST(encryptData(reqData, cryptoKey));
+    client.addHeader("Content-Type","aes128cbc");
+    client.addHeader("Authorization", auth.c_str());
+    client.setTimeout(500);
+    int httpCode = client.POST(encryptData(reqData, cryptoKey));
     trace(T_Emon,9);
-    size_t responseLength = http.getSize();
+    size_t responseLength = client.getSize();
     String response;
     if(responseLength <= 60){
-      response = http.getString();
+      response = client.getString();
     }	
     else{
       response = "Excessive length response: ";
       response += String(responseLength);
     }
-    http.end();
+    uploadEnd(client, startTime);
     if(httpCode != HTTP_CODE_OK){
       String code = String(httpCode);
       if(httpCode < 0){
-        code = http.errorToString(httpCode);
+        code = client.errorToString(httpCode);
       }
       msgLog("EmonService: POST failed. HTTP code: ", code);
       Serial.println(response);
@@ -0,0 +1,168 @@
+#include "IotaWatt.h"
+#include <FS.h>
+
+/***************************************************************************************************
+ *  Flash journal.
+ *
+ *  Writing a log record to the SD card every interval wears the card, and every so often the card
+ *  takes tens of ms to do its own housekeeping, right in the middle of sampling.  So dataLog writes
+ *  its records to a file in the ESP8266's own flash (SPIFFS), and logDrainService copies them to
+ *  the SD log in batches (logBatchRecords, config "logbatch") with a single flush.  The SD log is
+ *  behind by up to a batch, which is a minute at the usual settings.
+ *
+ *  Each entry is the record with its key and a check word in front.  The key is the sequence: the
+ *  log won't take a key it already has, so if the power goes after a batch is written but before
+ *  the journal is cleared, the batch is just skipped next time.  An entry that was being written
+ *  when the power went fails its check, and it and anything after it are dropped at startup.
+ *
+ *  The journal is limited to FLASH_JOURNAL_MAX bytes.  That's a couple of hours of records, so it
+ *  also carries an SD outage of that length (see logJournal.cpp for longer ones).
+ **************************************************************************************************/
+
+#define FLASH_JOURNAL_FILE "/logjrnl"
+#define FLASH_JOURNAL_TEMP "/logjrnl.tmp"
+#define FLASH_JOURNAL_MAX (512 * 1024)
+
+struct flashEntry {
+  uint32_t key;
+  uint32_t check;
+  IotaLogRecord record;
+};
+
+static boolean mounted = false;
+static uint32_t fileEntries = 0;              // Entries in the file
+static uint32_t drained = 0;                  // Entries already copied to the log
+
+static uint32_t entryCheck(flashEntry* entry);
+static boolean readEntry(fs::File& file, uint32_t n, flashEntry* entry);
+
+/***************************************************************************************************
+ *  flashJournalBegin() - Mount SPIFFS and pick up any journal left from before the restart,
+ *  dropping a partly written entry at the end.
+ **************************************************************************************************/
+boolean flashJournalBegin(){
+  if(mounted) return true;
+  if( ! SPIFFS.begin()){
+    msgLog(F("flashJournal: SPIFFS mount failed."));
+    return false;
+  }
+  mounted = true;
+  fileEntries = 0;
+  drained = 0;
+  fs::File file = SPIFFS.open(FLASH_JOURNAL_FILE, "r");
+  if( ! file) return true;
+  uint32_t entries = file.size() / sizeof(flashEntry);
+  flashEntry* entry = new flashEntry;
+  uint32_t valid = 0;
+  while(valid < entries && readEntry(file, valid, entry)) valid++;
+  boolean torn = valid != entries || file.size() % sizeof(flashEntry);
+  if(torn){
+    fs::File temp = SPIFFS.open(FLASH_JOURNAL_TEMP, "w");
+    for(uint32_t n=0; n<valid; n++){
+      readEntry(file, n, entry);
+      temp.write((uint8_t*)entry, sizeof(flashEntry));
+    }
+    temp.close();
+  }
+  file.close();
+  delete entry;
+  if(torn){
+    SPIFFS.remove(FLASH_JOURNAL_FILE);
+    SPIFFS.rename(FLASH_JOURNAL_TEMP, FLASH_JOURNAL_FILE);
+    msgLog("flashJournal: dropped partial entry after entries: ", valid);
+  }
+  fileEntries = valid;
+  if(fileEntries) msgLog("flashJournal: entries to write: ", fileEntries);
+  return true;
+}
+
+/***************************************************************************************************
+ *  flashJournalWrite() - Append a record.  Returns zero if it's safely in the journal.
+ **************************************************************************************************/
+int flashJournalWrite(IotaLogRecord* logRecord){
+  if( ! mounted) return 2;
+  if((fileEntries + 1) * sizeof(flashEntry) > FLASH_JOURNAL_MAX) return 3;
+  flashEntry* entry = new flashEntry;
+  entry->key = logRecord->UNIXtime;
+  entry->record = *logRecord;
+  entry->check = entryCheck(entry);
+  fs::File file = SPIFFS.open(FLASH_JOURNAL_FILE, "a");
+  size_t written = 0;
+  if(file){
+    written = file.write((uint8_t*)entry, sizeof(flashEntry));
+    file.close();
+  }
+  delete entry;
+  if(written != sizeof(flashEntry)){
+    msgLog(F("flashJournal: write failed."));
+    return 3;
+  }
+  fileEntries++;
+  return 0;
+}
+
+/***************************************************************************************************
+ *  flashJournalDrain() - Copy up to maxRecords entries to the data log, flushing it once at the
+ *  end, and clear the journal when they've all been copied.  Returns the entries still to go,
+ *  or -1 if the log couldn't be written.
+ **************************************************************************************************/
+int flashJournalDrain(uint32_t maxRecords){
+  if( ! mounted || fileEntries == 0) return 0;
+  fs::File file = SPIFFS.open(FLASH_JOURNAL_FILE, "r");
+  if( ! file) return 0;
+  flashEntry* entry = new flashEntry;
+  int rtc = 0;
+  uint32_t count = 0;
+  while(drained < fileEntries && count++ < maxRecords){
+    if( ! readEntry(file, drained, entry)){
+      drained = fileEntries;
+      break;
+    }
+    rtc = iotaLog.write(&entry->record, false);
+    if(rtc > 1) break;
+    if(rtc == 0) outputLogWrite(&entry->record);
+    drained++;
+  }
+  file.close();
+  delete entry;
+  iotaLog.flush();
+  if(rtc > 1) return -1;
+  if(drained >= fileEntries){
+    SPIFFS.remove(FLASH_JOURNAL_FILE);
+    fileEntries = 0;
+    drained = 0;
+  }
+  return fileEntries - drained;
+}
+
+/***************************************************************************************************
+ *  flashJournalLast() - Get the last record in the journal.  False if there isn't one.
+ **************************************************************************************************/
+boolean flashJournalLast(IotaLogRecord* logRecord){
+  if( ! mounted || fileEntries == 0) return false;
+  fs::File file = SPIFFS.open(FLASH_JOURNAL_FILE, "r");
+  if( ! file) return false;
+  flashEntry* entry = new flashEntry;
+  boolean found = readEntry(file, fileEntries - 1, entry);
+  if(found) *logRecord = entry->record;
+  file.close();
+  delete entry;
+  return found;
+}
+
+uint32_t flashJournalEntries(){return fileEntries - drained;}
+
+static boolean readEntry(fs::File& file, uint32_t n, flashEntry* entry){
+  file.seek(n * sizeof(flashEntry));
+  if(file.read((uint8_t*)entry, sizeof(flashEntry)) != sizeof(flashEntry)) return false;
+  return entry->key == entry->record.UNIXtime && entry->check == entryCheck(entry);
+}
+
+static uint32_t entryCheck(flashEntry* entry){
+  uint32_t check = 2166136261UL;                    // FNV-1a
+  uint8_t* byte = (uint8_t*)&entry->record;
+  for(int i=0; i<sizeof(IotaLogRecord); i++){
+    check = (check ^ byte[i]) * 16777619UL;
+  }
+  return check ^ entry->key;
+}
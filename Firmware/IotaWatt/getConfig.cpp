@@ -1,6 +1,7 @@
 #include "IotaWatt.h"
 
 void configInputs(JsonArray& JsonInputs);
+void scriptErrors(ScriptSet* scripts);
 void hashFile(uint8_t* sha, File file);
 uint32_t condensedJsonSize(File JsonFile);
 void condenseJson(char* ConfigBuffer, File JsonFile);
@@ -56,6 +57,42 @@ boolean getConfig(void)
     updateClass = Config["update"].as<String>();
   }
 
+  if(Config.containsKey("logbatch")){
+    logBatchRecords = Config["logbatch"].as<unsigned int>();
+  }
+
+  bool modbusWas = modbusEnabled;
+  uint16_t modbusPortWas = modbusPort;
+  modbusEnabled = false;
+  modbusPort = 502;
+  if(Config.containsKey("modbus")){
+    modbusEnabled = true;
+    if(Config["modbus"].as<JsonObject&>().containsKey("port")){
+      modbusPort = Config["modbus"]["port"].as<unsigned int>();
+    }
+  }
+  if(modbusEnabled != modbusWas || modbusPort != modbusPortWas){
+    modbusStop();
+  }
+
+  multicastEnabled = false;
+  if(Config.containsKey("multicast")){
+    multicastEnabled = true;
+    JsonObject& multicast = Config["multicast"];
+    if(multicast.containsKey("group")){
+      IPAddress group;
+      if(group.fromString(multicast["group"].as<char*>())){
+        multicastGroup = group;
+      }
+      else {
+        msgLog("getConfig: invalid multicast group ", multicast["group"].as<String>());
+      }
+    }
+    if(multicast.containsKey("port")){
+      multicastPort = multicast["port"].as<unsigned int>();
+    }
+  }
+
   int channels = 21;
   if(device.containsKey("version")){
     deviceVersion = device["version"].as<unsigned int>();
@@ -142,12 +179,100 @@ boolean getConfig(void)
   JsonVariant var = Config["outputs"];
   if(var.success()){
     outputs = new ScriptSet(var.as<JsonArray>()); 
+    scriptErrors(outputs);
+    Script* script = outputs->first();
+    for(int i=0; script; i++, script = script->next()){
+      if(var[i]["realtime"].as<bool>() && ! script->realtime()){
+        msgLog("Output can't be run realtime: ", script->name());
+      }
+    }
+  }
+  else outputs = nullptr;
+  realtimeConfigure();
+  outputLogReconcile = true;
+      
+        // ************************************ configure fast log *******************************
+
+  fastLogChannels = 0;
+  if(Config.containsKey("fastlog")){
+    JsonObject& fast = Config["fastlog"].as<JsonObject&>();
+    if(fast.containsKey("interval")){
+      uint32_t interval = fast["interval"].as<unsigned int>();
+      if(interval && dataLogInterval % interval == 0){
+        fastLogInterval = interval;
+      }
+      else {
+        msgLog("fastLog: interval must divide the log interval, ignored: ", String(interval));
+      }
+    }
+    for(int i=0; i<fast["channels"].size(); i++){
+      int channel = fast["channels"][i].as<int>();
+      if(channel >= 0 && channel < maxInputs) fastLogChannels |= 1 << channel;
+    }
+  }
+  if(fastLogChannels && ! fastLogStarted){
+    NewService(fastLogService);
+    fastLogStarted = true;
+  }
+
+  pqEnabled = false;
+  if(Config.containsKey("pq")){
+    JsonObject& pq = Config["pq"];
+    pqNominal = pq.containsKey("nominal") ? pq["nominal"].as<float>() * 10 : 0;
+    pqSagPercent = pq.containsKey("sag") ? pq["sag"].as<unsigned int>() : 90;
+    pqSwellPercent = pq.containsKey("swell") ? pq["swell"].as<unsigned int>() : 110;
+    pqInterruptPercent = pq.containsKey("interrupt") ? pq["interrupt"].as<unsigned int>() : 10;
+    pqHysteresisPercent = pq.containsKey("hysteresis") ? pq["hysteresis"].as<unsigned int>() : 2;
+    if(pqHysteresisPercent >= pqSwellPercent) pqHysteresisPercent = 0;
+    pqEnabled = true;
+  }
+  if(pqEnabled && ! pqStarted){
+    NewService(pqService);
+    pqStarted = true;
+  }
+
+  captureAbort();                       // Don't leave the main loop held on a channel
+  captureEnabled = false;
+  captureChannels = 0;
+  if(Config.containsKey("capture")){
+    JsonObject& capture = Config["capture"];
+    for(int i=0; i<capture["channels"].size(); i++){
+      int channel = capture["channels"][i].as<int>();
+      if(channel >= 0 && channel < maxInputs) captureChannels |= 1 << channel;
+    }
+    captureStepAmps = capture.containsKey("step") ? capture["step"].as<float>() : 0;
+    captureDipPercent = capture.containsKey("dip") ? capture["dip"].as<unsigned int>() : 0;
+    captureCycles = capture.containsKey("cycles") ? capture["cycles"].as<unsigned int>() : 3;
+    captureCycles = MIN(MAX(captureCycles, 1), 16);
+    if( ! captureStarted){
+      captureRingSize = capture.containsKey("ring") ? capture["ring"].as<unsigned int>() : 8192;
+    }
+    captureEnabled = captureChannels != 0;
+  }
+  if(captureEnabled && ! captureStarted){
+    NewService(captureService);
+    captureStarted = true;
+  }
+
+  loadEventChannels = 0;
+  if(Config.containsKey("loadevents")){
+    JsonObject& loadEvents = Config["loadevents"];
+    for(int i=0; i<loadEvents["channels"].size(); i++){
+      int channel = loadEvents["channels"][i].as<int>();
+      if(channel >= 0 && channel < maxInputs) loadEventChannels |= 1 << channel;
+    }
+    loadEventMinWatts = loadEvents.containsKey("minstep") ? loadEvents["minstep"].as<float>() : 30;
+  }
+  if(loadEventChannels && ! loadEventStarted){
+    NewService(loadEventService);
+    loadEventStarted = true;
   }
       
         // Get server type
                                                   
   String serverType = Config["server"]["type"].as<String>();
   serverType.toLowerCase();
+  uploadFingerprint = Config["server"]["fingerprint"].as<String>();
   
       // ************************************** configure EmonCMS **********************************
 
@@ -156,9 +281,13 @@ boolean getConfig(void)
     if(influxStarted) influxStop = true;
     SD.remove((char *)influxPostLogFile.c_str());
     EmonURL = Config["server"]["url"].as<String>();
+    EmonHTTPS = false;
+    EmonPort = 80;
     if(EmonURL.startsWith("http://")) EmonURL = EmonURL.substring(7);
     else if(EmonURL.startsWith("https://")){
       EmonURL = EmonURL.substring(8);
+      EmonHTTPS = true;
+      EmonPort = 443;
     }
     EmonURI = "";
     if(EmonURL.indexOf("/") > 0){
@@ -186,6 +315,7 @@ boolean getConfig(void)
     JsonVariant var = Config["server"]["outputs"];
     if(var.success()){
       emonOutputs = new ScriptSet(var.as<JsonArray>());
+      scriptErrors(emonOutputs);
       Script* script = emonOutputs->first();
       int index = 0;
       while(script){
@@ -200,6 +330,9 @@ boolean getConfig(void)
       }
     }
     
+    if(EmonHTTPS && uploadFingerprint.length() == 0){
+      msgLog(F("EmonService: https needs the server's certificate fingerprint."));
+    }
     if( ! EmonStarted) {
       NewService(EmonService);
       EmonStarted = true;
@@ -213,9 +346,13 @@ boolean getConfig(void)
     if(EmonStarted) EmonStop = true;
     SD.remove((char *)EmonPostLogFile.c_str());
     influxURL = Config["server"]["url"].as<String>();
+    influxHTTPS = false;
     if(influxURL.startsWith("http")){
       influxURL.remove(0,4);
-      if(influxURL.startsWith("s"))influxURL.remove(0,1);
+      if(influxURL.startsWith("s")){
+        influxURL.remove(0,1);
+        influxHTTPS = true;
+      }
       if(influxURL.startsWith(":"))influxURL.remove(0,1);
       while(influxURL.startsWith("/")) influxURL.remove(0,1);
     }
@@ -229,11 +366,16 @@ boolean getConfig(void)
     influxBulkSend = Config["server"]["bulksend"].as<int>();
     if(influxBulkSend > 10) influxBulkSend = 10;
     if(influxBulkSend <1) influxBulkSend = 1;
+    influxQuality = Config["server"]["quality"].as<bool>();
 
     delete influxOutputs;
     JsonVariant var = Config["server"]["outputs"];
     if(var.success()){
       influxOutputs = new ScriptSet(var.as<JsonArray>()); 
+      scriptErrors(influxOutputs);
+    }
+    if(influxHTTPS && uploadFingerprint.length() == 0){
+      msgLog(F("influxDB: https needs the server's certificate fingerprint."));
     }
     if( ! influxStarted) {
       NewService(influxService);
@@ -295,6 +437,12 @@ void configInputs(JsonArray& JsonInputs){
   }
 }
 
+void scriptErrors(ScriptSet* scripts){
+  for(Script* script = scripts->first(); script; script = script->next()){
+    if(script->error()) msgLog(String("Output ") + script->name() + ' ' + script->error());
+  }
+}
+
 void hashFile(uint8_t* sha, File file){
   int buffSize = 256;
   uint8_t* buff = new uint8_t[buffSize];
@@ -9,6 +9,9 @@ uint32_t influxService(struct serviceBlock* _serviceBlock){
   static IotaLogRecord* logRecord = new IotaLogRecord;
   static File influxPostLog;
   static double accum1Then [MAXINPUTS];
+  static double accum2Then [MAXINPUTS];
+  static uint32_t cyclesThen [MAXINPUTS];
+  static uint32_t failuresThen [MAXINPUTS];
   static uint32_t UnixLastPost = UNIXtime();
   static uint32_t UnixNextPost = UNIXtime();
   static double _logHours;
@@ -17,6 +20,8 @@ uint32_t influxService(struct serviceBlock* _serviceBlock){
   static uint32_t reqUnixtime = 0;
   static int  reqEntries = 0; 
   static uint32_t postTime = millis();
+  static seriesState* series = nullptr;
+  static size_t seriesCount = 0;
   struct SDbuffer {uint32_t data; SDbuffer(){data = 0;}};
   static SDbuffer* buf = new SDbuffer;
           
@@ -82,10 +87,21 @@ uint32_t influxService(struct serviceBlock* _serviceBlock){
       for(int i=0; i<maxInputs; i++){ 
         accum1Then[i] = logRecord->channel[i].accum1;
         if(accum1Then[i] != accum1Then[i]) accum1Then[i] = 0;
+        accum2Then[i] = logRecord->channel2[i].accum2;
+        if(accum2Then[i] != accum2Then[i]) accum2Then[i] = 0;
+        cyclesThen[i] = logRecord->count[i].cycles;
+        failuresThen[i] = logRecord->count[i].failures;
       }
       _logHours = logRecord->logHours;
       if(_logHours != _logHours) _logHours = 0;
 
+          // Posts are taken from log records, so the post interval has to be
+          // a multiple of the log interval.
+
+      if(influxDBInterval % iotaLog.interval()){
+        influxDBInterval += iotaLog.interval() - influxDBInterval % iotaLog.interval();
+      }
+
           // Assume that record was posted (not important).
           // Plan to start posting one interval later
       
@@ -97,6 +113,9 @@ uint32_t influxService(struct serviceBlock* _serviceBlock){
 
       reqData = "";
       reqEntries = 0;
+      delete[] series;
+      series = nullptr;
+      seriesCount = 0;
       state = post;
       _serviceBlock->priority = priorityLow;
       return UnixNextPost;
@@ -151,20 +170,44 @@ uint32_t influxService(struct serviceBlock* _serviceBlock){
      
           // Build the request string.
           // values for each channel are (delta value hrs)/(delta log hours) = period value.
+          // Values held back by their deadband are left out, and a held back value
+          // that's needed as a boundary goes in ahead of the new one.
           // Update the previous (Then) buckets to the most recent values.
      
       trace(T_influx,2);
+      if(seriesCount != influxOutputs->count()){
+        delete[] series;
+        seriesCount = influxOutputs->count();
+        series = new seriesState[seriesCount];
+      }
       Script* script = influxOutputs->first();
-      while(script){
-        reqData += script->name();
-        double value = script->run([](int i)->double {return (logRecord->channel[i].accum1 - accum1Then[i]) / elapsedHours;});
-        reqData += " value=" + String(value,1) + ' ' + String(UnixNextPost) + "\n";
+      influxOutputs->memoBegin();
+      for(int n=0; script; n++){
+        double value = scriptValue(script, logRecord, accum1Then, accum2Then, elapsedHours);
+        int send = seriesFilter(script, &series[n], value, UnixNextPost);
+        if(send & SERIES_BOUNDARY){
+          reqData += String(script->name()) + " value=" + String(series[n].heldValue,1) + ' ' + String(series[n].heldTime) + "\n";
+        }
+        if(send & SERIES_SEND){
+          reqData += script->name();
+          reqData += " value=" + String(value,1);
+          if(influxQuality){
+            uint32_t cycles, failures;
+            scriptCounts(script, logRecord, cyclesThen, failuresThen, &cycles, &failures);
+            reqData += ",cycles=" + String(cycles) + "i,failures=" + String(failures) + 'i';
+          }
+          reqData += ' ' + String(UnixNextPost) + "\n";
+        }
         script = script->next();
       }
+      influxOutputs->memoEnd();
 
       _logHours = logRecord->logHours;
       for(int i=0; i<MAXINPUTS; ++i){
         accum1Then[i] = logRecord->channel[i].accum1;
+        accum2Then[i] = logRecord->channel2[i].accum2;
+        cyclesThen[i] = logRecord->count[i].cycles;
+        failuresThen[i] = logRecord->count[i].failures;
       }
       
       trace(T_influx,3);  
@@ -178,9 +221,9 @@ uint32_t influxService(struct serviceBlock* _serviceBlock){
         return UnixNextPost;
       }
 
-          // Send the post       
+          // Send the post (unless everything was held back)
 
-      if(!influxSendData(reqUnixtime, reqData)){
+      if(reqData.length() && !influxSendData(reqUnixtime, reqData)){
         state = resend;
         return UNIXtime() + 30;
       }
@@ -216,9 +259,7 @@ uint32_t influxService(struct serviceBlock* _serviceBlock){
 
 /************************************************************************************************
  *  influxSend - send data to the influx server. 
- *  if secure transmission is configured, pas sthe request to a 
- *  similar WiFiClientSecure function.
- *  Secure takes about twice as long and can block sampling for more than a second.
+ *  An https:// server is posted over a connection kept open between posts (see uploadHTTP.cpp).
  ***********************************************************************************************/
 boolean influxSendData(uint32_t reqUnixtime, String reqData){ 
   trace(T_influx,7);
@@ -226,18 +267,20 @@ boolean influxSendData(uint32_t reqUnixtime, String reqData){
   String URI = "/write?precision=s&db=" + influxDataBase;
   Serial.print(influxURL);
   Serial.println(URI);
-  http.begin(influxURL, influxPort, URI);
-  http.addHeader("Host",influxURL);
-  http.addHeader("Content-Type","application/x-www-form-urlencoded");
-  http.setTimeout(500);
+  HTTPClient* httpClient = uploadBegin(influxURL, influxPort, URI, influxHTTPS);
+  if( ! httpClient) return false;
+  HTTPClient& client = *httpClient;
+  client.addHeader("Host",influxURL);
+  client.addHeader("Content-Type","application/x-www-form-urlencoded");
+  client.setTimeout(500);
   Serial.print(reqData);
-  int httpCode = http.POST(reqData);
-  String response = http.getString();
-  http.end();
+  int httpCode = client.POST(reqData);
+  String response = client.getString();
+  uploadEnd(client, startTime);
   if(httpCode != HTTP_CODE_OK && httpCode != 204){
     String code = String(httpCode);
     if(httpCode < 0){
-      code = http.errorToString(httpCode);
+      code = client.errorToString(httpCode);
     }
     msgLog("influxDB: POST failed. HTTP code: ", code);
     Serial.println(response);
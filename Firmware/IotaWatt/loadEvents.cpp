@@ -0,0 +1,272 @@
+#include "IotaWatt.h"
+
+/***************************************************************************************************
+ *  Load events - appliances turning on and off, from steps in a channel's power.
+ *
+ *  Enabled with "loadevents":{"channels":[...],"minstep":<watts>} in the config.  Each time
+ *  samplePower measures one of the channels, the watts go to loadEventDetect:
+ *
+ *    Steady    Within the threshold of the channel's level, the level and its noise (mean absolute
+ *              deviation) follow slowly.  The threshold is LOAD_NOISE_FACTOR times the noise, but
+ *              at least "minstep" (default 30) watts, so a noisy channel needs a bigger step.
+ *    Step      LOAD_CONFIRM measurements in a row beyond the threshold, the same way and agreeing
+ *              with each other, make a new level.  So an inrush spike on its own isn't a step.
+ *    Pairing   An upward step (on) is held, up to LOAD_OPEN per channel.  A downward step (off)
+ *              is paired with the held on closest to it in size, if within LOAD_PAIR_PERCENT.
+ *    Clusters  Each pair's size goes into the running statistics (Welford's mean and variance) of
+ *              the closest of LOAD_CLUSTERS clusters per channel, or starts a new one.  Over time a
+ *              cluster is an appliance: the fridge's compressor, the water heater.
+ *
+ *  Ons and offs are queued, and loadEventService writes them to the event log on the SD card, a
+ *  EventLog of LOAD_LOG_EVENTS slots, as the power quality event log is.
+ *
+ *  The state is allocated when the service starts (about 2K for 15 channels).  The work per
+ *  measurement is a few float operations, or a search of LOAD_OPEN and LOAD_CLUSTERS entries on a
+ *  step.  The CPU cycles it takes are counted, and reported with the events.
+ *
+ *  GET /loadevents?since=<UNIXtime>&count=<n>&channel=<n> lists events at or after since, oldest
+ *  first, up to count (default and most LOAD_QUERY_MAX), optionally for one channel.  It also
+ *  lists the clusters and the cost.
+ **************************************************************************************************/
+
+#define LOAD_CONFIRM 2                      // Measurements to confirm a step
+#define LOAD_NOISE_FACTOR 4                 // Threshold in multiples of noise
+#define LOAD_OPEN 4                         // Ons waiting for their off, per channel
+#define LOAD_PAIR_PERCENT 20                // Most an off can differ from its on
+#define LOAD_CLUSTERS 4                     // Per channel
+#define LOAD_CLUSTER_PERCENT 15             // Most a pair can differ from its cluster's mean
+#define LOAD_QUEUE 8                        // Events waiting for loadEventService
+#define LOAD_LOG_EVENTS 4096                // Slots in the event log
+#define LOAD_QUERY_MAX 200                  // Most events in a reply
+#define LOAD_NO_CLUSTER 0xFF
+
+enum loadEventTypes: uint8_t {loadOn=1, loadOff=2};
+
+struct loadEvent {                          // As in the event log
+  uint32_t sequence;                        // From 1, zero for an unused slot
+  uint32_t time;                            // UNIXtime
+  float    watts;                           // Size of the step
+  uint32_t duration;                        // Off: seconds since its on, zero if not paired
+  uint8_t  channel;
+  uint8_t  type;                            // loadEventTypes
+  uint8_t  cluster;                         // Off: cluster of the pair, or LOAD_NO_CLUSTER
+  uint8_t  reserved;
+  loadEvent(){sequence=0; time=0; watts=0; duration=0; channel=0; type=0; cluster=LOAD_NO_CLUSTER; reserved=0;}
+};
+
+struct loadCluster {
+  float    mean;                            // Watts
+  float    m2;                              // Sum of squared differences from the mean
+  uint32_t count;                           // Pairs
+  uint32_t seconds;                         // Total on time
+};
+
+struct loadChannel {                        // Detector state
+  float    level;                           // Steady power
+  float    noise;                           // Mean absolute deviation from level
+  float    pendingSum;                      // Measurements beyond threshold
+  uint8_t  pendingCount;
+  int8_t   pendingDir;
+  bool     primed;                          // level set
+  uint8_t  openCount;
+  struct {
+    float    watts;
+    uint32_t time;
+  } open [LOAD_OPEN];
+  loadCluster cluster [LOAD_CLUSTERS];
+};
+
+static loadChannel* channels = nullptr;
+static loadEvent queue [LOAD_QUEUE];
+static EventLog loadLog(loadEventLogFile, sizeof(loadEvent), LOAD_LOG_EVENTS, (uint8_t*)queue, LOAD_QUEUE);
+static CycleCost cost;
+
+static void loadStep(int channel, loadChannel* state, float watts);
+static uint8_t loadPair(loadChannel* state, float watts, uint32_t seconds);
+static void loadQueue(int channel, uint8_t type, float watts, uint32_t duration, uint8_t cluster);
+
+/***************************************************************************************************
+ *  loadEventDetect() - Look at a power measurement of a channel.
+ **************************************************************************************************/
+void loadEventDetect(int channel, float watts){
+  if( ! channels || channel < 0 || channel >= MAXINPUTS || ! (loadEventChannels & (1 << channel))) return;
+  uint32_t startCycles = ESP.getCycleCount();
+  loadChannel* state = &channels[channel];
+  if( ! state->primed){
+    state->level = watts;
+    state->primed = true;
+    return;
+  }
+  float threshold = LOAD_NOISE_FACTOR * state->noise;
+  if(threshold < loadEventMinWatts) threshold = loadEventMinWatts;
+  float deviation = watts - state->level;
+
+  if(abs(deviation) < threshold){
+    state->level += deviation / 8;
+    state->noise += (abs(deviation) - state->noise) / 16;
+    state->pendingCount = 0;
+  }
+  else {
+    int8_t dir = deviation > 0 ? 1 : -1;
+    if(state->pendingCount &&
+      (dir != state->pendingDir || abs(watts - state->pendingSum / state->pendingCount) >= threshold)){
+      state->pendingCount = 0;
+    }
+    if(state->pendingCount == 0) state->pendingSum = 0;
+    state->pendingSum += watts;
+    state->pendingCount++;
+    state->pendingDir = dir;
+    if(state->pendingCount >= LOAD_CONFIRM){
+      float level = state->pendingSum / state->pendingCount;
+      loadStep(channel, state, level - state->level);
+      state->level = level;
+      state->pendingCount = 0;
+    }
+  }
+
+  cost.count(ESP.getCycleCount() - startCycles);
+}
+
+        // A confirmed step.  Ons are held, offs paired with one.
+
+static void loadStep(int channel, loadChannel* state, float watts){
+  uint32_t now = UNIXtime();
+  if(watts > 0){
+    if(state->openCount == LOAD_OPEN){
+      memmove(&state->open[0], &state->open[1], (LOAD_OPEN - 1) * sizeof(state->open[0]));
+      state->openCount--;
+    }
+    state->open[state->openCount].watts = watts;
+    state->open[state->openCount].time = now;
+    state->openCount++;
+    loadQueue(channel, loadOn, watts, 0, LOAD_NO_CLUSTER);
+    return;
+  }
+  int best = -1;
+  for(int i=0; i<state->openCount; i++){
+    if(best < 0 || abs(state->open[i].watts + watts) < abs(state->open[best].watts + watts)) best = i;
+  }
+  if(best < 0 || abs(state->open[best].watts + watts) * 100 > state->open[best].watts * LOAD_PAIR_PERCENT){
+    loadQueue(channel, loadOff, watts, 0, LOAD_NO_CLUSTER);
+    return;
+  }
+  float size = (state->open[best].watts - watts) / 2;
+  uint32_t seconds = now - state->open[best].time;
+  state->openCount--;
+  memmove(&state->open[best], &state->open[best + 1], (state->openCount - best) * sizeof(state->open[0]));
+  loadQueue(channel, loadOff, watts, seconds ? seconds : 1, loadPair(state, size, seconds));
+}
+
+        // Add a pair to the closest cluster, or start one (in place of the least used if full).
+
+static uint8_t loadPair(loadChannel* state, float watts, uint32_t seconds){
+  int best = -1;
+  int least = 0;
+  for(int i=0; i<LOAD_CLUSTERS; i++){
+    loadCluster* cluster = &state->cluster[i];
+    if(cluster->count < state->cluster[least].count) least = i;
+    if(cluster->count && abs(watts - cluster->mean) * 100 <= cluster->mean * LOAD_CLUSTER_PERCENT &&
+      (best < 0 || abs(watts - cluster->mean) < abs(watts - state->cluster[best].mean))){
+      best = i;
+    }
+  }
+  if(best < 0){
+    best = least;
+    state->cluster[best] = loadCluster();
+  }
+  loadCluster* cluster = &state->cluster[best];
+  cluster->count++;
+  float delta = watts - cluster->mean;
+  cluster->mean += delta / cluster->count;
+  cluster->m2 += delta * (watts - cluster->mean);
+  cluster->seconds += seconds;
+  return best;
+}
+
+static void loadQueue(int channel, uint8_t type, float watts, uint32_t duration, uint8_t cluster){
+  loadEvent* event = (loadEvent*)loadLog.queueSlot();
+  if( ! event) return;
+  event->time = UNIXtime();
+  event->watts = watts;
+  event->duration = duration;
+  event->channel = channel;
+  event->type = type;
+  event->cluster = cluster;
+  loadLog.queued();
+}
+
+/***************************************************************************************************
+ *  loadEventService - Allocate the detector state, then write queued events to the event log.
+ **************************************************************************************************/
+uint32_t loadEventService(struct serviceBlock* _serviceBlock){
+  if( ! channels){
+    msgLog(F("loadEventService: started."));
+    channels = new loadChannel [MAXINPUTS];
+    memset(channels, 0, MAXINPUTS * sizeof(loadChannel));
+  }
+  return loadLog.service();
+}
+
+/***************************************************************************************************
+ *  handleLoadEvents() - GET /loadevents
+ **************************************************************************************************/
+void handleLoadEvents(){
+  if( ! channels){
+    server.send(404, "text/plain", "Load events not configured");
+    return;
+  }
+  if( ! loadLog.ready()){
+    server.send(503, "text/plain", "Event log not ready");
+    return;
+  }
+  uint32_t since = server.hasArg("since") ? server.arg("since").toInt() : 0;
+  uint32_t count = server.hasArg("count") ? server.arg("count").toInt() : LOAD_QUERY_MAX;
+  int channel = server.hasArg("channel") ? server.arg("channel").toInt() : -1;
+  if(count == 0 || count > LOAD_QUERY_MAX) count = LOAD_QUERY_MAX;
+  DynamicJsonBuffer jsonBuffer;
+  JsonObject& root = jsonBuffer.createObject();
+  JsonArray& events = root.createNestedArray("events");
+  File eventLog = SD.open(loadEventLogFile, FILE_READ);
+  if(eventLog){
+    loadEvent event;
+    for(uint32_t sequence = loadLog.oldest(); sequence < loadLog.next() && events.size() < count; sequence++){
+      int rtc = loadLog.read(eventLog, sequence, (uint8_t*)&event);
+      if(rtc < 0) break;
+      if(rtc == 0 || event.time < since) continue;
+      if(channel >= 0 && event.channel != channel) continue;
+      JsonObject& item = events.createNestedObject();
+      item.set("time", event.time);
+      item.set("channel", event.channel);
+      item.set("name", inputChannel[event.channel]->_name);
+      item.set("type", event.type == loadOn ? "on" : "off");
+      item.set("watts", String(event.watts, 0));
+      if(event.duration) item.set("duration", event.duration);
+      if(event.cluster != LOAD_NO_CLUSTER) item.set("cluster", event.cluster);
+    }
+    eventLog.close();
+  }
+  JsonArray& clusters = root.createNestedArray("clusters");
+  for(int i=0; i<MAXINPUTS; i++){
+    if(channel >= 0 && i != channel) continue;
+    for(int j=0; j<LOAD_CLUSTERS; j++){
+      loadCluster* cluster = &channels[i].cluster[j];
+      if(cluster->count == 0) continue;
+      JsonObject& item = clusters.createNestedObject();
+      item.set("channel", i);
+      item.set("cluster", j);
+      item.set("watts", String(cluster->mean, 0));
+      item.set("sd", String(cluster->count > 1 ? sqrt(cluster->m2 / (cluster->count - 1)) : 0.0, 1));
+      item.set("count", cluster->count);
+      item.set("hours", String(cluster->seconds / 3600.0, 2));
+    }
+  }
+  JsonObject& costs = jsonBuffer.createObject();
+  costs.set("calls", cost.calls());
+  costs.set("avgus", String(cost.avgus(), 2));
+  costs.set("maxus", String(cost.maxus(), 2));
+  root.set("cost", costs);
+  root.set("dropped", loadLog.dropped());
+  String response;
+  root.printTo(response);
+  sendResponse(200, "application/json", response);
+}
@@ -0,0 +1,80 @@
+#include "IotaWatt.h"
+
+/***************************************************************************************************
+ *  Log journal.
+ *
+ *  When the data log can't be opened or written (card pulled, card failed, file damaged), dataLog
+ *  carries on sampling and keeps its records here, in RAM, until the log can be reopened.  They
+ *  are then written to the log in order, as if nothing had happened.
+ *
+ *  RAM is short, so the journal holds a limited number of records, sized from the free heap when
+ *  it starts.  When it fills up, every other record is dropped and from then on only every other
+ *  key is kept (the stride doubles).  Because the accumulators are cumulative nothing is lost by
+ *  dropping records, the log just ends up with coarser records over the outage.  A stride of 1
+ *  means every record was kept.
+ **************************************************************************************************/
+
+#define JOURNAL_MAX_RECORDS 64
+#define JOURNAL_MIN_RECORDS 4
+#define JOURNAL_HEAP_RESERVE 12000          // Leave this much heap for everybody else
+
+static IotaLogRecord* journal = nullptr;
+static uint32_t capacity = 0;
+static uint32_t entries = 0;
+static uint32_t stride = 1;
+
+/***************************************************************************************************
+ *  journalWrite() - Add a record to the journal, starting the journal if need be.
+ *  Records with keys that aren't on the current stride are ignored.
+ **************************************************************************************************/
+void journalWrite(IotaLogRecord* logRecord){
+  if( ! journal){
+    uint32_t heap = ESP.getFreeHeap();
+    capacity = heap > JOURNAL_HEAP_RESERVE ? (heap - JOURNAL_HEAP_RESERVE) / sizeof(IotaLogRecord) : 0;
+    if(capacity > JOURNAL_MAX_RECORDS) capacity = JOURNAL_MAX_RECORDS;
+    if(capacity < JOURNAL_MIN_RECORDS) capacity = JOURNAL_MIN_RECORDS;
+    journal = new IotaLogRecord[capacity];
+    entries = 0;
+    stride = 1;
+    msgLog("journal: started, records: ", capacity);
+  }
+  uint32_t interval = dataLogInterval ? dataLogInterval : 5;
+  if((logRecord->UNIXtime / interval) % stride) return;
+  if(entries && logRecord->UNIXtime <= journal[entries - 1].UNIXtime) return;
+
+        // Full.  Thin to the next stride until there's room.
+
+  while(entries == capacity){
+    stride *= 2;
+    uint32_t kept = 0;
+    for(int i=0; i<entries; i++){
+      if((journal[i].UNIXtime / interval) % stride == 0){
+        journal[kept++] = journal[i];
+      }
+    }
+    entries = kept;
+    if((logRecord->UNIXtime / interval) % stride) return;
+  }
+  journal[entries++] = *logRecord;
+}
+
+/***************************************************************************************************
+ *  journalRecord() - The n'th record in the journal, oldest first, nullptr past the end.
+ *  journalEnd() - Discard the journal (after it's been replayed) and free the memory.
+ **************************************************************************************************/
+IotaLogRecord* journalRecord(uint32_t n){
+  if( ! journal || n >= entries) return nullptr;
+  return &journal[n];
+}
+
+void journalEnd(){
+  delete[] journal;
+  journal = nullptr;
+  capacity = 0;
+  entries = 0;
+  stride = 1;
+}
+
+uint32_t journalEntries(){return entries;}
+uint32_t journalCapacity(){return capacity;}
+uint32_t journalStride(){return stride;}
@@ -0,0 +1,212 @@
+#include "IotaWatt.h"
+
+/***************************************************************************************************
+ *  Modbus TCP server.
+ *
+ *  For building management systems that poll.  Enabled with "modbus":{"port":502} in the config.
+ *  Read holding registers (3) and read input registers (4) both read the same register image,
+ *  which statService rebuilds each time it updates (modbusRefresh), so a request is just a copy
+ *  out of the image.  Nothing is allocated per request.  Any unit id is answered.
+ *
+ *  32 bit values take two registers, high word first.  Floats are IEEE 754.  64 bit values take
+ *  four registers, high word first.
+ *
+ *    0       Register map version (1)
+ *    1       Input channels
+ *    2       Outputs
+ *    3-4     UNIXtime of the image (uint32)
+ *    5       Status, bit 0: data log degraded (see dataLog)
+ *
+ *    100 + 16 x channel:
+ *    +0-1    Watts (float) - power channels
+ *    +2-3    Volts (float) - the channel's own for voltage channels, its VT's for power channels
+ *    +4-5    Hz (float) - same
+ *    +6-7    Power factor (float) - power channels
+ *    +8-11   Net watt-hours since the log began (int64) - power channels
+ *    +12-15  Export watt-hours since the log began (int64) - power channels
+ *
+ *    400 + 2 x output:
+ *    +0-1    Output value (float), outputs in config order
+ *
+ *  Registers in the image that aren't used read as zero.  Reads past the end of the image get an
+ *  illegal data address exception.  To try it from a PC: mbpoll -m tcp -r 101 -c 16 <address>
+ **************************************************************************************************/
+
+#define MODBUS_CLIENTS 2
+#define MODBUS_CHANNEL_BASE 100
+#define MODBUS_CHANNEL_REGS 16
+#define MODBUS_OUTPUT_BASE 400
+#define MODBUS_OUTPUTS 32
+#define MODBUS_REGISTERS (MODBUS_OUTPUT_BASE + MODBUS_OUTPUTS * 2)
+#define MODBUS_FRAME 260                    // MBAP header + largest PDU
+
+static uint16_t image [MODBUS_REGISTERS];
+static WiFiServer* modbusServer = nullptr;
+static WiFiClient clients [MODBUS_CLIENTS];
+static uint8_t frame [MODBUS_CLIENTS][MODBUS_FRAME];
+static uint16_t frameLen [MODBUS_CLIENTS];
+static uint8_t reply [MODBUS_FRAME];
+
+static void putFloat(int reg, float value);
+static void putInt64(int reg, int64_t value);
+static void modbusRequest(int n);
+
+/***************************************************************************************************
+ *  modbusPoll() - Called from the main loop.  Take new connections and answer complete requests.
+ **************************************************************************************************/
+void modbusPoll(){
+  if( ! modbusServer){
+    if(WiFi.status() != WL_CONNECTED) return;
+    modbusServer = new WiFiServer(modbusPort);
+    modbusServer->begin();
+    modbusServer->setNoDelay(true);
+    msgLog("Modbus: server started, port ", modbusPort);
+  }
+  if(modbusServer->hasClient()){
+    int n = 0;
+    while(n < MODBUS_CLIENTS - 1 && clients[n].connected()) n++;
+    clients[n].stop();
+    clients[n] = modbusServer->available();
+    frameLen[n] = 0;
+  }
+  for(int n=0; n<MODBUS_CLIENTS; n++){
+    if( ! clients[n].connected()) continue;
+    int available = clients[n].available();
+    if(available <= 0) continue;
+    if(available > MODBUS_FRAME - frameLen[n]) available = MODBUS_FRAME - frameLen[n];
+    frameLen[n] += clients[n].read(frame[n] + frameLen[n], available);
+    if(frameLen[n] < 7) continue;
+    uint16_t protocol = (frame[n][2] << 8) | frame[n][3];
+    uint16_t length = (frame[n][4] << 8) | frame[n][5];
+    if(protocol != 0 || length < 2 || length > MODBUS_FRAME - 6){
+      clients[n].stop();
+      continue;
+    }
+    if(frameLen[n] < 6 + length) continue;
+    modbusRequest(n);
+    frameLen[n] -= 6 + length;
+    memmove(frame[n], frame[n] + 6 + length, frameLen[n]);
+  }
+}
+
+/***************************************************************************************************
+ *  modbusStop() - Close the server and its connections.  Called by getConfig when modbus is
+ *  disabled or its port changes, modbusPoll starts it again as configured.
+ **************************************************************************************************/
+void modbusStop(){
+  for(int n=0; n<MODBUS_CLIENTS; n++){
+    clients[n].stop();
+    frameLen[n] = 0;
+  }
+  if(modbusServer){
+    modbusServer->stop();
+    delete modbusServer;
+    modbusServer = nullptr;
+    msgLog(F("Modbus: server stopped."));
+  }
+}
+
+/***************************************************************************************************
+ *  modbusRequest() - Answer the request at the front of a client's frame buffer.
+ **************************************************************************************************/
+static void modbusRequest(int n){
+  uint8_t* request = frame[n];
+  uint8_t function = request[7];
+  uint16_t requestLen = ((request[4] << 8) | request[5]) - 1;  // PDU, without the unit id
+  uint8_t exception = 0;
+  uint16_t pduLen = 2;
+  memcpy(reply, request, 7);                          // Transaction, protocol, (length), unit
+  reply[7] = function;
+  if(function != 3 && function != 4){
+    exception = 1;
+  }
+  else if(requestLen < 5){
+    exception = 3;
+  }
+  else {
+    uint16_t start = (request[8] << 8) | request[9];
+    uint16_t count = (request[10] << 8) | request[11];
+    if(count < 1 || count > 125){
+      exception = 3;
+    }
+    else if(start + count > MODBUS_REGISTERS){
+      exception = 2;
+    }
+    else {
+      statDemand();
+      reply[8] = count * 2;
+      for(int i=0; i<count; i++){
+        reply[9 + i * 2] = image[start + i] >> 8;
+        reply[10 + i * 2] = image[start + i] & 0xff;
+      }
+      pduLen = 2 + count * 2;
+    }
+  }
+  if(exception){
+    reply[7] = function | 0x80;
+    reply[8] = exception;
+  }
+  uint16_t length = pduLen + 1;
+  reply[4] = length >> 8;
+  reply[5] = length & 0xff;
+  clients[n].write(reply, 6 + length);
+}
+
+/***************************************************************************************************
+ *  modbusRefresh() - Rebuild the register image from statBucket.  Called by statService.
+ **************************************************************************************************/
+void modbusRefresh(){
+  static IotaInputChannel* _input;
+  memset(image, 0, sizeof(image));
+  image[0] = 1;
+  image[1] = maxInputs;
+  image[2] = 0;
+  uint32_t now = UNIXtime();
+  image[3] = now >> 16;
+  image[4] = now & 0xffff;
+  image[5] = dataLogDegraded ? 1 : 0;
+  for(int i=0; i<maxInputs && i<MAXINPUTS; i++){
+    _input = inputChannel[i];
+    if( ! _input || ! _input->isActive()) continue;
+    int reg = MODBUS_CHANNEL_BASE + i * MODBUS_CHANNEL_REGS;
+    if(_input->_type == channelTypeVoltage){
+      putFloat(reg + 2, statBucket[i].volts);
+      putFloat(reg + 4, statBucket[i].Hz);
+    }
+    else if(_input->_type == channelTypePower){
+      int v = _input->_vchannel;
+      putFloat(reg, statBucket[i].watts);
+      putFloat(reg + 2, statBucket[v].volts);
+      putFloat(reg + 4, statBucket[v].Hz);
+      double va = statBucket[i].amps * statBucket[v].volts;
+      if(va > 0) putFloat(reg + 6, statBucket[i].watts / va);
+      if(dataLogRecord){
+        putInt64(reg + 8, (int64_t)dataLogRecord->channel[i].accum1);
+        putInt64(reg + 12, (int64_t)dataLogRecord->channel2[i].accum2);
+      }
+    }
+  }
+  if(outputs){
+    int j = 0;
+    outputs->memoBegin();
+    for(Script* script = outputs->first(); script && j < MODBUS_OUTPUTS; script = script->next(), j++){
+      putFloat(MODBUS_OUTPUT_BASE + j * 2, script->run(statInput));
+    }
+    outputs->memoEnd();
+    image[2] = j;
+  }
+}
+
+static void putFloat(int reg, float value){
+  uint32_t bits;
+  memcpy(&bits, &value, 4);
+  image[reg] = bits >> 16;
+  image[reg + 1] = bits & 0xffff;
+}
+
+static void putInt64(int reg, int64_t value){
+  for(int i=3; i>=0; i--){
+    image[reg + i] = value & 0xffff;
+    value >>= 16;
+  }
+}
@@ -0,0 +1,104 @@
+#include "IotaWatt.h"
+
+/***************************************************************************************************
+ *  Multicast of the live readings.
+ *
+ *  For local displays and loggers that would otherwise each poll /status.  Enabled with
+ *  "multicast":{"group":"239.255.73.1","port":7377} in the config (both optional, those are the
+ *  defaults).  Each time statService updates statBucket (every statServiceInterval seconds, it
+ *  doesn't idle while this is on) one UDP datagram goes to the group, so any number of listeners
+ *  cost the same as one.  The datagram is built in a static buffer.
+ *
+ *  Layout, all values little-endian, floats IEEE 754:
+ *
+ *    0     4 bytes   "IOTA"
+ *    4     uint8     Layout version (1)
+ *    5     uint8     Channels (C)
+ *    6     uint8     Outputs (O)
+ *    7     uint8     Flags, bit 0: data log degraded
+ *    8     uint32    Sequence number, +1 each datagram
+ *    12    uint32    UNIXtime
+ *    16    uint32    Milliseconds since the last datagram
+ *    20    C x 12    Channels, in order:
+ *                      +0  uint8   Type: 0 not in use, 1 voltage, 2 power
+ *                      +1  uint8   Voltage channel (power channels)
+ *                      +2  uint16  Zero
+ *                      +4  float   Volts or watts
+ *                      +8  float   Hz or amps
+ *    20+12C  O x 4   Output values (float), in config order
+ *
+ *  Tools/multicastReceive.py prints them on a PC.
+ **************************************************************************************************/
+
+#define MULTICAST_HEADER 20
+#define MULTICAST_CHANNEL 12
+#define MULTICAST_OUTPUTS 32
+#define MULTICAST_SIZE (MULTICAST_HEADER + MAXINPUTS * MULTICAST_CHANNEL + MULTICAST_OUTPUTS * 4)
+
+static WiFiUDP multicastUDP;
+static uint8_t packet [MULTICAST_SIZE];
+static uint32_t sequence = 0;
+static uint32_t lastMs = 0;
+
+static void put32(int offset, uint32_t value);
+static void putFloat(int offset, float value);
+
+/***************************************************************************************************
+ *  multicastSend() - Send statBucket as it stands.  Called by statService.
+ **************************************************************************************************/
+void multicastSend(){
+  if(WiFi.status() != WL_CONNECTED) return;
+  uint32_t now = millis();
+  int channels = maxInputs < MAXINPUTS ? maxInputs : MAXINPUTS;
+  memcpy(packet, "IOTA", 4);
+  packet[4] = 1;
+  packet[5] = channels;
+  packet[7] = dataLogDegraded ? 1 : 0;
+  put32(8, sequence++);
+  put32(12, UNIXtime());
+  put32(16, lastMs ? now - lastMs : 0);
+  lastMs = now;
+  int offset = MULTICAST_HEADER;
+  for(int i=0; i<channels; i++){
+    IotaInputChannel* _input = inputChannel[i];
+    memset(packet + offset, 0, MULTICAST_CHANNEL);
+    if(_input && _input->isActive()){
+      if(_input->_type == channelTypeVoltage){
+        packet[offset] = 1;
+      }
+      else if(_input->_type == channelTypePower){
+        packet[offset] = 2;
+        packet[offset + 1] = _input->_vchannel;
+      }
+      putFloat(offset + 4, statBucket[i].value1);
+      putFloat(offset + 8, statBucket[i].value2);
+    }
+    offset += MULTICAST_CHANNEL;
+  }
+  int count = 0;
+  if(outputs){
+    outputs->memoBegin();
+    for(Script* script = outputs->first(); script && count < MULTICAST_OUTPUTS; script = script->next(), count++){
+      putFloat(offset, script->run(statInput));
+      offset += 4;
+    }
+    outputs->memoEnd();
+  }
+  packet[6] = count;
+  multicastUDP.beginPacketMulticast(multicastGroup, multicastPort, WiFi.localIP());
+  multicastUDP.write(packet, offset);
+  multicastUDP.endPacket();
+}
+
+static void put32(int offset, uint32_t value){
+  for(int i=0; i<4; i++){
+    packet[offset + i] = value & 0xff;
+    value >>= 8;
+  }
+}
+
+static void putFloat(int offset, float value){
+  uint32_t bits;
+  memcpy(&bits, &value, 4);
+  put32(offset, bits);
+}
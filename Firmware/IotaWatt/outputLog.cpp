@@ -0,0 +1,361 @@
+#include "IotaWatt.h"
+
+/***************************************************************************************************
+ *  Output log.
+ *
+ *  Outputs are Scripts over the inputs, so graphing one normally means running its Script for
+ *  every record of the query, and editing a Script quietly rewrites its history.  An output with
+ *  "log":true is also computed by dataLog as each record is written, and its value*hours kept in
+ *  an IotaLog of its own, one column (channel) per output.  Queries read it like an input.
+ *
+ *  The columns are described in outputLogColumnsFile, by output name, with the hash of the Script
+ *  that produced them and the key ("since") from which it did.  When a logged Script is changed,
+ *  its column carries on with the new Script from the next record, and queries before that fall
+ *  back to running the Script.  Energy is since the data log began, which a column doesn't go back
+ *  to, so each version also keeps a base: the Script's energy less the column's at the first
+ *  record it wrote ("origin").  Energy from then on is the column plus the base.  The "rebuildoutputs" command recomputes the whole output log from
+ *  the data log with the current Scripts, in the background.  The log is written to the other of
+ *  two files (A and B), and swapped in when it has caught up.
+ **************************************************************************************************/
+
+#define OUTPUT_COLUMNS 15
+
+struct outputColumn {
+  String name;
+  uint32_t hash;
+  uint32_t since;
+  uint32_t origin;                                // Key the base was taken at, zero until then
+  double base;                                    // Energy (Wh) before the column, from origin
+  Script* script;                                 // Current Script, nullptr if not logged now
+};
+static outputColumn columns[OUTPUT_COLUMNS];
+static char activeFile = 'A';
+static boolean columnsLoaded = false;
+
+static IotaLogRecord* outRecord = nullptr;        // Last written output record
+static double accum1Then [MAXINPUTS];             // Data log record it was computed to
+static double accum2Then [MAXINPUTS];
+static double logHoursThen = 0;
+
+static void loadColumns();
+static void saveColumns();
+static void reconcileColumns();
+static void computeOutputs(IotaLogRecord* logRecord, IotaLogRecord* record, double* a1Then, double* a2Then, double* hoursThen);
+static double scriptEnergy(Script* script, IotaLogRecord* logRecord);
+
+/***************************************************************************************************
+ *  outputLogWrite() - called by dataLog with each record written to the data log.
+ *  Opens the output log the first time there are logged outputs, picking up from the
+ *  record passed.
+ **************************************************************************************************/
+void outputLogWrite(IotaLogRecord* logRecord){
+  if(outputLogReconcile){
+    reconcileColumns();
+    outputLogReconcile = false;
+  }
+  if( ! outputLog.isOpen()){
+    boolean logged = false;
+    for(int i=0; i<OUTPUT_COLUMNS; i++) if(columns[i].script) logged = true;
+    if( ! logged) return;
+    String path = outputLogFile + activeFile;
+    if(int rtc = outputLog.begin((char*)path.c_str(), iotaLog.interval())){
+      msgLog("outputLog: Log file open failed. ", String(rtc));
+      return;
+    }
+    if( ! outRecord) outRecord = new IotaLogRecord;
+    if(outputLog.lastKey()){
+      outRecord->UNIXtime = outputLog.lastKey();
+      outputLog.readKey(outRecord);
+    }
+    for(int i=0; i<MAXINPUTS; i++){
+      accum1Then[i] = logRecord->channel[i].accum1;
+      accum2Then[i] = logRecord->channel2[i].accum2;
+    }
+    logHoursThen = logRecord->logHours;
+    msgLog("outputLog: started, file ", path);
+    return;
+  }
+  computeOutputs(logRecord, outRecord, accum1Then, accum2Then, &logHoursThen);
+  outputLog.write(outRecord);
+  boolean based = false;
+  for(int i=0; i<OUTPUT_COLUMNS; i++){
+    if(columns[i].script && columns[i].origin == 0 && outRecord->UNIXtime >= columns[i].since){
+      columns[i].base = scriptEnergy(columns[i].script, logRecord) - outRecord->channel[i].accum1;
+      columns[i].origin = outRecord->UNIXtime;
+      based = true;
+    }
+  }
+  if(based) saveColumns();
+}
+
+/***************************************************************************************************
+ *  outputLogColumn() - Column of the output log holding a Script's values, or -1 if none.
+ *  outputLogSince() - First key of the column computed by the current Script.
+ *  outputLogOrigin() - First key the column's energy can be had from, zero if not yet.
+ *  outputLogBase() - Energy (Wh) to add to the column's from there.
+ **************************************************************************************************/
+int outputLogColumn(Script* script){
+  if( ! outputLog.isOpen() || outputLogReconcile || ! script) return -1;
+  for(int i=0; i<OUTPUT_COLUMNS; i++){
+    if(columns[i].script == script && columns[i].hash == script->hash()) return i;
+  }
+  return -1;
+}
+
+uint32_t outputLogSince(int column){
+  return columns[column].since;
+}
+
+uint32_t outputLogOrigin(int column){
+  return columns[column].origin;
+}
+
+double outputLogBase(int column){
+  return columns[column].base;
+}
+
+/***************************************************************************************************
+ *  outputRebuildService - Recompute the output log from the beginning of the data log with the
+ *  current Scripts.  Runs at low priority, a few records per dispatch, into the inactive file,
+ *  then swaps it in.
+ **************************************************************************************************/
+uint32_t outputRebuildService(struct serviceBlock* _serviceBlock){
+  enum states {initialize, build};
+  static states state = initialize;
+  static IotaLog* rebuildLog = nullptr;
+  static IotaLogRecord* logRecord = nullptr;
+  static IotaLogRecord* record = nullptr;
+  static double a1Then [MAXINPUTS];
+  static double a2Then [MAXINPUTS];
+  static double hoursThen;
+  static String path;
+
+  switch(state){
+
+    case initialize: {
+      if( ! outputLog.isOpen() || iotaLog.firstKey() == 0){
+        msgLog(F("outputLog: nothing to rebuild."));
+        outputRebuilding = false;
+        return 0;
+      }
+      msgLog(F("outputLog: rebuild started."));
+      path = outputLogFile + (activeFile == 'A' ? 'B' : 'A');
+      SD.remove((char*)(path + ".log").c_str());
+      SD.remove((char*)(path + ".ndx").c_str());
+      SD.remove((char*)(path + ".sum").c_str());
+      rebuildLog = new IotaLog;
+      if(rebuildLog->begin((char*)path.c_str(), iotaLog.interval())){
+        msgLog(F("outputLog: rebuild open failed."));
+        delete rebuildLog;
+        outputRebuilding = false;
+        return 0;
+      }
+      logRecord = new IotaLogRecord;
+      record = new IotaLogRecord;
+      logRecord->UNIXtime = iotaLog.firstKey();
+      iotaLog.readKey(logRecord);
+      for(int i=0; i<MAXINPUTS; i++){
+        a1Then[i] = logRecord->channel[i].accum1;
+        a2Then[i] = logRecord->channel2[i].accum2;
+      }
+      hoursThen = logRecord->logHours;
+      record->UNIXtime = logRecord->UNIXtime;
+      record->logHours = logRecord->logHours;
+      rebuildLog->write(record);
+      _serviceBlock->priority = priorityLow;
+      state = build;
+      return 1;
+    }
+
+    case build: {
+      if(outputLogReconcile){
+        reconcileColumns();
+        outputLogReconcile = false;
+      }
+      for(int n=0; n<16; n++){
+        if(iotaLog.readNext(logRecord)){
+
+              // Caught up with the data log.  Swap the logs.
+              // If the new one won't open, stay on the old one.
+              // The columns start at zero, so their base is the Scripts'
+              // energy at the first record.
+
+          outputLog.end();
+          rebuildLog->end();
+          delete rebuildLog;
+          outputRebuilding = false;
+          state = initialize;
+          String oldPath = outputLogFile + activeFile;
+          if(int rtc = outputLog.begin((char*)path.c_str(), iotaLog.interval())){
+            msgLog("outputLog: rebuilt log open failed, keeping the old one. ", String(rtc));
+            outputLog.begin((char*)oldPath.c_str(), iotaLog.interval());
+            SD.remove((char*)(path + ".log").c_str());
+            SD.remove((char*)(path + ".ndx").c_str());
+            SD.remove((char*)(path + ".sum").c_str());
+            delete logRecord;
+            delete record;
+            return 0;
+          }
+          SD.remove((char*)(oldPath + ".log").c_str());
+          SD.remove((char*)(oldPath + ".ndx").c_str());
+          SD.remove((char*)(oldPath + ".sum").c_str());
+          activeFile = (activeFile == 'A' ? 'B' : 'A');
+          logRecord->UNIXtime = iotaLog.firstKey();
+          iotaLog.readKey(logRecord);
+          for(int i=0; i<OUTPUT_COLUMNS; i++){
+            if(columns[i].script){
+              columns[i].hash = columns[i].script->hash();
+              columns[i].since = iotaLog.firstKey();
+              columns[i].origin = iotaLog.firstKey();
+              columns[i].base = scriptEnergy(columns[i].script, logRecord);
+            }
+            else {
+              columns[i].name = "";
+            }
+          }
+          saveColumns();
+          if( ! outRecord) outRecord = new IotaLogRecord;
+          *outRecord = *record;
+          for(int i=0; i<MAXINPUTS; i++){
+            accum1Then[i] = a1Then[i];
+            accum2Then[i] = a2Then[i];
+          }
+          logHoursThen = hoursThen;
+          delete logRecord;
+          delete record;
+          msgLog(F("outputLog: rebuild complete."));
+          return 0;
+        }
+        computeOutputs(logRecord, record, a1Then, a2Then, &hoursThen);
+        rebuildLog->write(record);
+      }
+      return 1;
+    }
+  }
+  return 1;
+}
+
+/***************************************************************************************************
+ *  computeOutputs() - Advance an output record to a data log record.  Each logged output's
+ *  value over the interval is added to its column as value*hours.  A real-time output adds what
+ *  it integrated over the record's interval instead, if that's still known.
+ **************************************************************************************************/
+static void computeOutputs(IotaLogRecord* logRecord, IotaLogRecord* record, double* a1Then, double* a2Then, double* hoursThen){
+  double elapsedHours = logRecord->logHours - *hoursThen;
+  if(elapsedHours > 0 && outputs){
+    outputs->memoBegin();
+    for(int i=0; i<OUTPUT_COLUMNS; i++){
+      if( ! columns[i].script) continue;
+      double wattHours = columns[i].script->realtime() ? realtimeTake(columns[i].script, logRecord->UNIXtime) : NAN;
+      if(wattHours == wattHours){
+        record->channel[i].accum1 += wattHours;
+      }
+      else {
+        double value = scriptValue(columns[i].script, logRecord, a1Then, a2Then, elapsedHours);
+        if(value == value) record->channel[i].accum1 += value * elapsedHours;
+      }
+    }
+    outputs->memoEnd();
+  }
+  for(int i=0; i<MAXINPUTS; i++){
+    a1Then[i] = logRecord->channel[i].accum1;
+    a2Then[i] = logRecord->channel2[i].accum2;
+  }
+  *hoursThen = logRecord->logHours;
+  record->UNIXtime = logRecord->UNIXtime;
+  record->logHours = logRecord->logHours;
+}
+
+/***************************************************************************************************
+ *  scriptEnergy() - A Script's energy (Wh) since the data log began, as of a data log record.
+ **************************************************************************************************/
+static double scriptEnergy(Script* script, IotaLogRecord* logRecord){
+  static IotaLogRecord* _logRecord;
+  _logRecord = logRecord;
+  double energy = script->run([](int i, Script::measures measure)->double {
+    return Script::measured(measure, _logRecord->channel[i].accum1, logsExport(i) ? _logRecord->channel2[i].accum2 : 0);});
+  return energy == energy ? energy : 0;
+}
+
+/***************************************************************************************************
+ *  reconcileColumns() - Match the columns to the current logged outputs after the config has
+ *  been (re)loaded.  A changed Script keeps its column but starts a new "since", a new output
+ *  gets a free column.  Either takes a new base at its first record.  Columns of outputs no longer logged keep their history.
+ **************************************************************************************************/
+static void reconcileColumns(){
+  if( ! columnsLoaded){
+    loadColumns();
+    columnsLoaded = true;
+  }
+  uint32_t nextKey = iotaLog.lastKey() + iotaLog.interval();
+  boolean changed = false;
+  for(int i=0; i<OUTPUT_COLUMNS; i++) columns[i].script = nullptr;
+  Script* script = outputs ? outputs->first() : nullptr;
+  for( ; script; script = script->next()){
+    if( ! script->logged()) continue;
+    int column = -1;
+    for(int i=0; i<OUTPUT_COLUMNS; i++){
+      if(columns[i].name.equals(script->name())) column = i;
+    }
+    if(column < 0){
+      for(int i=0; i<OUTPUT_COLUMNS && column < 0; i++){
+        if(columns[i].name.length() == 0) column = i;
+      }
+      if(column < 0){
+        msgLog("outputLog: no column for ", script->name());
+        continue;
+      }
+      columns[column].name = script->name();
+      columns[column].hash = 0;
+    }
+    columns[column].script = script;
+    if(columns[column].hash != script->hash()){
+      columns[column].hash = script->hash();
+      columns[column].since = nextKey;
+      columns[column].origin = 0;
+      changed = true;
+    }
+  }
+  if(changed) saveColumns();
+}
+
+static void loadColumns(){
+  File columnsFile = SD.open(outputLogColumnsFile, FILE_READ);
+  if( ! columnsFile) return;
+  DynamicJsonBuffer Json;
+  JsonObject& root = Json.parseObject(columnsFile.readString());
+  columnsFile.close();
+  if( ! root.success()) return;
+  activeFile = root["active"].as<String>() == "B" ? 'B' : 'A';
+  JsonArray& array = root["columns"];
+  for(int i=0; i<OUTPUT_COLUMNS && i<array.size(); i++){
+    columns[i].name = array[i]["name"].as<String>();
+    columns[i].hash = array[i]["hash"].as<uint32_t>();
+    columns[i].since = array[i]["since"].as<uint32_t>();
+    columns[i].origin = array[i]["origin"].as<uint32_t>();
+    columns[i].base = array[i]["base"].as<double>();
+  }
+}
+
+static void saveColumns(){
+  DynamicJsonBuffer Json;
+  JsonObject& root = Json.createObject();
+  root["active"] = String(activeFile);
+  JsonArray& array = root.createNestedArray("columns");
+  for(int i=0; i<OUTPUT_COLUMNS; i++){
+    JsonObject& column = array.createNestedObject();
+    column["name"] = columns[i].name;
+    column["hash"] = columns[i].hash;
+    column["since"] = columns[i].since;
+    column["origin"] = columns[i].origin;
+    column["base"] = columns[i].base;
+  }
+  String text;
+  root.printTo(text);
+  SD.remove((char*)outputLogColumnsFile.c_str());
+  File columnsFile = SD.open(outputLogColumnsFile, FILE_WRITE);
+  if(columnsFile){
+    columnsFile.print(text);
+    columnsFile.close();
+  }
+}
@@ -0,0 +1,187 @@
+#include "IotaWatt.h"
+
+/***************************************************************************************************
+ *  Power quality events - sags, swells and interruptions.
+ *
+ *  Enabled with "pq":{...} in the config.  Every Vrms measurement samplePower makes (one cycle of
+ *  a VT, on its own or with a CT) goes through pqDetect.  It's compared, in whole integer
+ *  deci-volts, with the reference: the "nominal" volts from the config, or if there isn't one, a
+ *  slow moving average of the channel's own measurements outside of events.
+ *
+ *    Sag           below "sag" percent of the reference (default 90), until back above sag +
+ *                  "hysteresis" percent (default 2).
+ *    Swell         above "swell" percent (default 110), until back below swell - hysteresis.
+ *    Interruption  a sag that went below "interrupt" percent (default 10).  A VT that stops
+ *                  giving a signal counts as zero volts.
+ *
+ *  A channel is measured every few hundred ms, in turn with the others, so the duration is only
+ *  as good as that and an event shorter than the gap between measurements can be missed.
+ *
+ *  Detection is a few compares on per-channel state, so it's fine in the sampling path.  Finished
+ *  events are queued, and pqService writes them to the event log on the SD card, an EventLog of
+ *  PQ_LOG_EVENTS slots, so it never grows beyond 80K.
+ *
+ *  GET /pq/events?since=<UNIXtime>&count=<n> lists events that started at or after since (default
+ *  all), oldest first, up to count (default and most PQ_QUERY_MAX).  To page through them, ask
+ *  again with since after the start of the last one.
+ **************************************************************************************************/
+
+#define PQ_QUEUE 8                          // Events waiting for pqService
+#define PQ_LOG_EVENTS 4096                  // Slots in the event log
+#define PQ_QUERY_MAX 200                    // Most events in a reply
+#define PQ_REFERENCE_SHIFT 10               // Moving average over about this power of 2 measurements
+
+enum pqTypes: uint8_t {pqNone=0, pqSag=1, pqSwell=2, pqInterruption=3};
+
+struct pqEvent {                            // As in the event log
+  uint32_t sequence;                        // From 1, zero for an unused slot
+  uint32_t start;                           // UNIXtime
+  uint32_t durationMs;
+  uint8_t  channel;
+  uint8_t  type;                            // pqTypes
+  uint16_t extreme;                         // Lowest (sag, interruption) or highest (swell), dV
+  uint16_t reference;                       // dV
+  uint16_t reserved;
+  pqEvent(){sequence=0; start=0; durationMs=0; channel=0; type=pqNone; extreme=0; reference=0; reserved=0;}
+};
+
+struct pqChannel {                          // Detector state
+  uint32_t reference;                       // Moving average, dV << 8, zero until first measured
+  uint32_t startMs;                         // Event in progress
+  uint32_t start;
+  uint16_t extreme;
+  pqTypes  type;
+  pqChannel(){reference=0; startMs=0; start=0; extreme=0; type=pqNone;}
+};
+
+static pqChannel channels [MAXINPUTS];
+static pqEvent queue [PQ_QUEUE];
+static EventLog pqLog(pqLogFile, sizeof(pqEvent), PQ_LOG_EVENTS, (uint8_t*)queue, PQ_QUEUE);
+
+static const char* pqTypeName(uint8_t type);
+static void pqWritten(const uint8_t* record);
+
+/***************************************************************************************************
+ *  pqDetect() - Check a Vrms measurement of a voltage channel.
+ **************************************************************************************************/
+void pqDetect(int channel, float Vrms){
+  if(channel < 0 || channel >= MAXINPUTS) return;
+  pqChannel* state = &channels[channel];
+  uint32_t dV = Vrms > 0 ? Vrms * 10 : 0;
+  if(state->reference == 0){
+    if(dV == 0) return;
+    state->reference = dV << 8;
+  }
+  uint32_t reference = pqNominal ? pqNominal : state->reference >> 8;
+  uint32_t level = dV * 100;
+
+  if(state->type == pqNone){
+    if(level < reference * pqSagPercent){
+      state->type = pqSag;
+    }
+    else if(level > reference * pqSwellPercent){
+      state->type = pqSwell;
+    }
+    else {
+      state->reference += ((int32_t)(dV << 8) - (int32_t)state->reference) >> PQ_REFERENCE_SHIFT;
+      return;
+    }
+    state->startMs = millis();
+    state->start = UNIXtime();
+    state->extreme = dV;
+    return;
+  }
+
+  if(state->type == pqSag){
+    if(dV < state->extreme) state->extreme = dV;
+    if(level <= reference * (pqSagPercent + pqHysteresisPercent)) return;
+  }
+  else {
+    if(dV > state->extreme) state->extreme = dV;
+    if(level >= reference * (pqSwellPercent - pqHysteresisPercent)) return;
+  }
+
+        // Event over, queue it.
+
+  pqEvent* event = (pqEvent*)pqLog.queueSlot();
+  if(event){
+    event->start = state->start;
+    event->durationMs = millis() - state->startMs;
+    event->channel = channel;
+    event->type = state->type;
+    if(state->type == pqSag && state->extreme * 100 < reference * pqInterruptPercent){
+      event->type = pqInterruption;
+    }
+    event->extreme = state->extreme;
+    event->reference = reference;
+    pqLog.queued();
+  }
+  state->type = pqNone;
+}
+
+/***************************************************************************************************
+ *  pqService - Write finished events to the event log.
+ **************************************************************************************************/
+uint32_t pqService(struct serviceBlock* _serviceBlock){
+  static bool started = false;
+  if( ! started){
+    msgLog(F("pqService: started."));
+    started = true;
+  }
+  return pqLog.service(pqWritten);
+}
+
+static void pqWritten(const uint8_t* record){
+  const pqEvent* event = (const pqEvent*)record;
+  msgLog("pq: " + String(pqTypeName(event->type)) + " on " + inputChannel[event->channel]->_name + ", " +
+         String(event->extreme / 10.0, 1) + "V for " + String(event->durationMs) + "ms");
+}
+
+/***************************************************************************************************
+ *  handlePQEvents() - GET /pq/events
+ **************************************************************************************************/
+void handlePQEvents(){
+  if( ! pqEnabled){
+    server.send(404, "text/plain", "Power quality events not configured");
+    return;
+  }
+  if( ! pqLog.ready()){
+    server.send(503, "text/plain", "Event log not ready");
+    return;
+  }
+  uint32_t since = server.hasArg("since") ? server.arg("since").toInt() : 0;
+  uint32_t count = server.hasArg("count") ? server.arg("count").toInt() : PQ_QUERY_MAX;
+  if(count == 0 || count > PQ_QUERY_MAX) count = PQ_QUERY_MAX;
+  DynamicJsonBuffer jsonBuffer;
+  JsonObject& root = jsonBuffer.createObject();
+  JsonArray& events = root.createNestedArray("events");
+  File eventLog = SD.open(pqLogFile, FILE_READ);
+  if(eventLog){
+    pqEvent event;
+    for(uint32_t sequence = pqLog.oldest(); sequence < pqLog.next() && events.size() < count; sequence++){
+      int rtc = pqLog.read(eventLog, sequence, (uint8_t*)&event);
+      if(rtc < 0) break;
+      if(rtc == 0 || event.start < since) continue;
+      JsonObject& item = events.createNestedObject();
+      item.set("start", event.start);
+      item.set("duration", event.durationMs);
+      item.set("channel", event.channel);
+      item.set("name", inputChannel[event.channel]->_name);
+      item.set("type", pqTypeName(event.type));
+      item.set("extreme", String(event.extreme / 10.0, 1));
+      item.set("reference", String(event.reference / 10.0, 1));
+    }
+    eventLog.close();
+  }
+  root.set("dropped", pqLog.dropped());
+  String response;
+  root.printTo(response);
+  sendResponse(200, "application/json", response);
+}
+
+static const char* pqTypeName(uint8_t type){
+  if(type == pqSag) return "sag";
+  if(type == pqSwell) return "swell";
+  if(type == pqInterruption) return "interruption";
+  return "none";
+}
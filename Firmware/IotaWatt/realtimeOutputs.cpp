@@ -0,0 +1,157 @@
+#include "IotaWatt.h"
+
+/***************************************************************************************************
+ *  Real-time outputs.
+ *
+ *  An output's value is normally its Script run over interval averages, so an output like
+ *  (@1+@2)| with "measure":"import" loses whatever the sum's sign did within the interval.  An
+ *  output with "realtime":true is instead run by samplePower each time a channel is measured,
+ *  over the latest watts (or volts) of every channel, and its value integrated over time.  The
+ *  measure applies to the Script's result, so import is the import of the sum.  (Outputs it
+ *  refers to have their usual value, by their own measure of each input.)  A real-time
+ *  output is logged: at each data log interval dataLog marks the watt-hours integrated over it
+ *  (realtimeMark), keyed by the record's UNIXtime, and outputLogWrite puts them in the output's
+ *  column when that record reaches the log, however late the journals deliver it.  The last
+ *  REALTIME_MARKS intervals are kept.  A record older than that (after a long outage, or in a
+ *  rebuild of the output log) can only have its value recomputed from interval averages.
+ *
+ *  Measurements are integrated over any gap between them, holding the last value, as the
+ *  inputs' own accumulators are.
+ *
+ *  Scripts run compiled (Script::runCompiled), on a float array of the latest values this keeps
+ *  up to date, so the work per measurement is a few float operations per output.  The CPU
+ *  cycles are counted, and reported in /status?stats.  Up to REALTIME_OUTPUTS are run.
+ **************************************************************************************************/
+
+#define REALTIME_OUTPUTS 8
+#define REALTIME_GAP_MS 2000                // Longer than this between measurements is timed by millis()
+#define REALTIME_MARKS 64                   // Intervals' watt-hours kept for the output log
+
+struct realtimeOutput {
+  Script*  script;
+  String   name;
+  float    value;                           // Last result, held until the next
+  double   wattHours;                       // Integrated since last taken
+};
+
+static realtimeOutput realtime [REALTIME_OUTPUTS];
+static float inputs [MAXINPUTS];            // Latest value of each channel
+static float exported [MAXINPUTS];          // and its negative part, for Scripts that measure import or export
+static uint32_t lastCycleCount = 0;
+static uint32_t lastMs = 0;
+static float hoursPerCycle = 0;
+static CycleCost cost;
+static uint32_t markKey [REALTIME_MARKS];   // UNIXtime of each interval marked
+static float* marks = nullptr;              // Its watt-hours, realtimeOutputs per mark
+static uint32_t markCount = 0;              // Marked, wraps
+
+/***************************************************************************************************
+ *  realtimeConfigure() - Pick up the real-time outputs after the config has been (re)loaded.
+ *  An output that's still there by name keeps what it had integrated.
+ **************************************************************************************************/
+void realtimeConfigure(){
+  realtimeOutput previous [REALTIME_OUTPUTS];
+  int previousOutputs = realtimeOutputs;
+  for(int i=0; i<realtimeOutputs; i++) previous[i] = realtime[i];
+  int count = 0;
+  Script* script = outputs ? outputs->first() : nullptr;
+  for( ; script; script = script->next()){
+    if( ! script->realtime()) continue;
+    if(count == REALTIME_OUTPUTS){
+      msgLog("realtime: too many outputs, not run: ", script->name());
+      continue;
+    }
+    realtimeOutput* output = &realtime[count++];
+    output->script = script;
+    output->name = script->name();
+    output->value = 0;
+    output->wattHours = 0;
+    for(int i=0; i<realtimeOutputs; i++){
+      if(previous[i].name.equals(output->name)){
+        output->value = previous[i].value;
+        output->wattHours = previous[i].wattHours;
+      }
+    }
+  }
+
+        // Carry the marks over to the new order, by name.
+
+  float* previousMarks = marks;
+  marks = count ? new float [REALTIME_MARKS * count] : nullptr;
+  for(int i=0; i<count; i++){
+    int from = -1;
+    for(int j=0; j<previousOutputs; j++){
+      if(previous[j].name.equals(realtime[i].name)) from = j;
+    }
+    for(int mark=0; mark<REALTIME_MARKS; mark++){
+      marks[mark * count + i] = from >= 0 && previousMarks ? previousMarks[mark * previousOutputs + from] : NAN;
+    }
+  }
+  delete[] previousMarks;
+  realtimeOutputs = count;
+  hoursPerCycle = 1.0 / (ESP.getCpuFreqMHz() * 1000000.0 * 3600.0);
+}
+
+/***************************************************************************************************
+ *  realtimeCycle() - A channel (and, for a power channel, its VT) has just been measured.
+ *  Integrate each output's value since the last measurement, then run it with the new values.
+ **************************************************************************************************/
+void realtimeCycle(int channel, float value, int vchannel, float volts){
+  uint32_t startCycles = ESP.getCycleCount();
+  uint32_t timeNow = millis();
+  inputs[channel] = value;
+  exported[channel] = value < 0 ? -value : 0;
+  if(vchannel >= 0) inputs[vchannel] = volts;
+  float hours = (startCycles - lastCycleCount) * hoursPerCycle;
+  if(timeNow - lastMs >= REALTIME_GAP_MS) hours = (timeNow - lastMs) / 3600000.0;   // Cycle count may have wrapped
+  bool integrate = lastMs != 0;
+  lastCycleCount = startCycles;
+  lastMs = timeNow;
+  outputs->memoBegin();
+  for(int i=0; i<realtimeOutputs; i++){
+    realtimeOutput* output = &realtime[i];
+    if(integrate) output->wattHours += output->value * hours;
+    float result = output->script->runCompiled(inputs, exported, Script::measureNet);
+    if(output->script->measure() == Script::measureImport) result = result > 0 ? result : 0;
+    else if(output->script->measure() == Script::measureExport) result = result < 0 ? -result : 0;
+    output->value = result;
+  }
+  outputs->memoEnd();
+
+  cost.count(ESP.getCycleCount() - startCycles);
+}
+
+/***************************************************************************************************
+ *  realtimeMark() - A data log interval ending at UNIXtime has closed.  Keep what each output
+ *  has integrated over it.
+ *  realtimeTake() - The watt-hours a real-time output integrated over the interval ending at
+ *  UNIXtime, NaN if that isn't known.
+ **************************************************************************************************/
+void realtimeMark(uint32_t UNIXtime){
+  if( ! marks) return;
+  int mark = markCount++ % REALTIME_MARKS;
+  markKey[mark] = UNIXtime;
+  for(int i=0; i<realtimeOutputs; i++){
+    marks[mark * realtimeOutputs + i] = realtime[i].wattHours;
+    realtime[i].wattHours = 0;
+  }
+}
+
+double realtimeTake(Script* script, uint32_t UNIXtime){
+  for(int i=0; i<realtimeOutputs; i++){
+    if(realtime[i].script != script) continue;
+    for(int mark=0; mark<REALTIME_MARKS; mark++){
+      if(markKey[mark] == UNIXtime) return marks[mark * realtimeOutputs + i];
+    }
+  }
+  return NAN;
+}
+
+/***************************************************************************************************
+ *  realtimeStatus() - The cost, for /status?stats.
+ **************************************************************************************************/
+void realtimeStatus(JsonObject& stats){
+  stats.set("realtimeoutputs", realtimeOutputs);
+  stats.set("realtimeavgus", String(cost.avgus(), 2));
+  stats.set("realtimemaxus", String(cost.maxus(), 2));
+}
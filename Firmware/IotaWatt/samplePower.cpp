@@ -1,4 +1,9 @@
 #include "IotaWatt.h"
+
+static bool samplesIrregular = false;     // Set by sampleCycle when sample intervals are not uniform
+static uint32_t biasSettled = 0;          // Bit per channel, set when offset correction first within 1
+
+static void measureFrequency(IotaInputChannel* Vchannel, uint32_t crossCycles, float cycleHz);
   
   /***************************************************************************************************
   *  samplePower()  Sample a channel.
@@ -11,7 +16,11 @@ void samplePower(int channel, int overSample){
 
   trace(T_POWER,0);
   if(inputChannel[channel]->_type == channelTypeVoltage){
-    inputChannel[channel]->setVoltage(sampleVoltage(channel, inputChannel[channel]->_calibration));                                                                        
+    bool noSignal = false;
+    float Vrms = sampleVoltage(channel, inputChannel[channel]->_calibration, &noSignal);
+    inputChannel[channel]->setVoltage(Vrms);
+    if(pqEnabled && (Vrms > 0 || noSignal)) pqDetect(channel, Vrms);   // Not a sampling failure
+    if(realtimeOutputs) realtimeCycle(channel, Vrms);
     return;
   }
 
@@ -40,8 +49,11 @@ void samplePower(int channel, int overSample){
  
   if(int rtc = sampleCycle(Vchannel, Ichannel, 1, 0)) {
     trace(T_POWER,2);
-    if(rtc == 2){
+    if(captureHold == channel) captureAbort();
+    if(rtc >= 2){
       Ichannel->setPower(0.0, 0.0);
+      if(pqEnabled && rtc == 3) pqDetect(Ichannel->_vchannel, 0.0);
+      if(realtimeOutputs) realtimeCycle(channel, 0.0);
     }
     return;
   }          
@@ -53,6 +65,12 @@ void samplePower(int channel, int overSample){
   int32_t sumP = 0;
   int32_t sumVsq = 0;
   int32_t sumIsq = 0;  
+  int32_t sumW = 0;
+  int64_t sumVw = 0;
+  int64_t sumIw = 0;
+  int64_t sumPw = 0;
+  int64_t sumVsqW = 0;
+  int64_t sumIsqW = 0;
 
       // Determine phase correction components.
       // stepCorrection is the number of I samples to add or subtract.
@@ -82,9 +100,31 @@ void samplePower(int channel, int overSample){
     sumI += rawI;
     sumIsq += rawI * rawI;
     sumP += rawV * rawI;      
+    if(samplesIrregular){
+      int32_t w = Tsample[i] + Tsample[i+1];
+      sumW += w;
+      sumVw += (int64_t)rawV * w;
+      sumVsqW += (int64_t)(rawV * rawV) * w;
+      sumIw += (int64_t)rawI * w;
+      sumIsqW += (int64_t)(rawI * rawI) * w;
+      sumPw += (int64_t)(rawV * rawI) * w;
+    }
     VsamplePtr++;
     Iindex = (Iindex + 1) % samples;
   }
+
+        // If the sample intervals were not uniform, the simple sums are biased
+        // toward the densely sampled parts of the cycle.  Weight each sample by
+        // the time it represents (trapezoidal rule using the cycle counter intervals
+        // on either side) and scale back to equivalent uniform sums.
+
+  if(samplesIrregular && sumW > 0){
+    sumV = sumVw * samples / sumW;
+    sumVsq = sumVsqW * samples / sumW;
+    sumI = sumIw * samples / sumW;
+    sumIsq = sumIsqW * samples / sumW;
+    sumP = sumPw * samples / sumW;
+  }
   
         // Adjust the offset values assuming symmetric waves but within limits otherwise.
  
@@ -94,6 +134,7 @@ void samplePower(int channel, int overSample){
   trace(T_POWER,4);
   if(sumV >= 0) sumV += samples / 2;
   else sumV -= samples / 2;
+  if(abs(sumV / samples) <= 1) biasSettled |= 1 << Vchan;
   int16_t offsetV = Vchannel->_offset + sumV / samples;
   if(offsetV < minOffset) offsetV = minOffset;
   if(offsetV > maxOffset) offsetV = maxOffset;
@@ -101,6 +142,7 @@ void samplePower(int channel, int overSample){
   
   if(sumI >= 0) sumI += samples / 2;
   else sumI -= samples / 2;
+  if(abs(sumI / samples) <= 1) biasSettled |= 1 << Ichan;
   int16_t offsetI = Ichannel->_offset + sumI / samples;
   if(offsetI < minOffset) offsetI = minOffset;
   if(offsetI > maxOffset) offsetI = maxOffset;
@@ -136,11 +178,18 @@ void samplePower(int channel, int overSample){
     }
   }
 
+      // Look for a transient to capture, before the last values are replaced.
+
+  if(captureEnabled) captureCycle(Ichannel, Vchannel, _Irms, _Vrms, Vratio, Iratio);
+
       // Update with the new power and voltage values.
 
   trace(T_POWER,5);
   Ichannel->setPower(_watts, _Irms);
   Vchannel->setVoltage(_Vrms);
+  if(loadEventChannels) loadEventDetect(channel, _watts);
+  if(pqEnabled) pqDetect(Vchan, _Vrms);
+  if(realtimeOutputs) realtimeCycle(channel, _watts, Vchan, _Vrms);
   trace(T_POWER,9);                                                                               
   return;
 }
@@ -174,11 +223,21 @@ void samplePower(int channel, int overSample){
   *  For anyone interested in the low level registers, you can find 
   *  them defined in esp8266_peri.h.
   *
+  *  Each sample pair is also tagged in Tsample with the interval since the previous pair,
+  *  taken from the cpu cycle counter (in units of 16 cycles).  Interrupts from the WiFi stack
+  *  can stretch an interval now and then.  When that happens, samplePower weights the samples
+  *  by actual time rather than rejecting the cycle.  Only a gap too large to interpolate
+  *  across is rejected.
+  *
   *  Return codes are:
   *   0 - success
-  *   1 - low quality sample (low sample rate, probably interrupted)
-  *   2 - failure (probably no voltage reference or voltage unplugged during sampling)
+  *   1 - low quality sample (excessive gap in sampling, probably interrupted)
+  *   2 - failure (sample timeout or too many samples, probably voltage unplugged during sampling)
+  *   3 - no voltage signal at all (no change in the first 2ms)
   *   
+  *  Each outcome is counted in the Ichannel's cycleCount (0) or cycleFailures (1 to 3), which
+  *  dataLog records so the quality of every log interval can be judged after the fact.
+  *
   ****************************************************************************************************/
   
   int sampleCycle(IotaInputChannel* Vchannel, IotaInputChannel* Ichannel, int cycles, int overSamples){
@@ -203,6 +262,12 @@ void samplePower(int channel, int overSample){
         
   int16_t * VsamplePtr = Vsample;             // -> to sample storage arrays
   int16_t * IsamplePtr = Isample;
+  uint16_t * TsamplePtr = Tsample;
+
+  uint32_t cycleNow = ESP.getCycleCount();    // Cycle counter at last V sample
+  uint32_t cycleThen = cycleNow;              // Cycle counter at the V sample before that
+  uint32_t interval;
+  uint16_t maxInterval = 0;                   // Largest interval between recorded samples
     
   int16_t crossLimit = cycles * 2 + 1;        // number of crossings in total
   int16_t crossCount = 0;                     // number of crossings encountered
@@ -210,8 +275,11 @@ void samplePower(int channel, int overSample){
 
   uint32_t startMs = millis();                // Start of current half cycle
   uint32_t timeoutMs = 12;                    // Maximum time allowed per half cycle
-  uint32_t firstCrossUs;                      // Time cycle at usec resolution for phase calculation
-  uint32_t lastCrossUs;                       
+  uint32_t crossAt;                           // Cycle counter at a crossing (interpolated)
+  uint32_t firstCross;                        // at the first crossing
+  uint32_t lastCross;                         // at the last
+  uint32_t risingCross;                       // at the first crossing going positive
+  bool     rising = false;                    // risingCross is set
 
   int16_t midCrossSamples;                    // Sample count at mid cycle and end of cycle
   int16_t lastCrossSamples;                   // Used to determine if sampling was interrupted
@@ -228,7 +296,8 @@ void samplePower(int channel, int overSample){
   lastV = readADC(Vchan) - offsetV;
   do {
     if((millis() - startMs) > 2){
-      return 2;
+      Ichannel->cycleFailures++;
+      return 3;
     }
     rawV = readADC(Vchan) - offsetV;   
   } while(abs(rawV - lastV) < 20);
@@ -260,18 +329,24 @@ void samplePower(int channel, int overSample){
           *IsamplePtr = (rawI + lastI) / 2;
           if(*IsamplePtr >= -1 && *IsamplePtr <= 1) *IsamplePtr = 0;
           lastI = rawI;
+          interval = (uint32_t)(cycleNow - cycleThen) >> 4;
+          *TsamplePtr = interval > 0xFFFF ? 0xFFFF : interval;
+          cycleThen = cycleNow;
                  
           // if((*IsamplePtr > -3) && (*IsamplePtr < 3)) *IsamplePtr = 0;       // Filter noise from previous reading while SPI reads ADC  
               
           if(crossCount) {                                  // If past first crossing 
+            if(*TsamplePtr > maxInterval) maxInterval = *TsamplePtr;
             VsamplePtr++;                                   // Accumulate samples
             IsamplePtr++; 
+            TsamplePtr++;
             if(crossCount < crossLimit){
               samples++;
               if(samples >= MAX_SAMPLES){                   // If over the legal limit
                 trace(T_SAMP,0);                            // shut down and return
                 GPOS = ADC_IselectMask;                     // (Chip select high) 
                 Serial.println("Max samples exceeded.");       
+                Ichannel->cycleFailures++;
                 return 2;
               }
             }
@@ -283,6 +358,7 @@ void samplePower(int channel, int overSample){
         
         while(SPI1CMD & SPIBUSY) {}                                         // Loop till SPI completes
         GPOS = ADC_VselectMask;                                             // digitalWrite(ADC_VselectPin, HIGH); Deselect the ADC 
+        cycleNow = ESP.getCycleCount();                                     // Timestamp the V sample
 
               // extract the rawV from the SPI hardware buffer and adjust with offset. 
                                                                     
@@ -316,6 +392,7 @@ void samplePower(int channel, int overSample){
             GPOS = ADC_VselectMask;                                     // ADC select pin high 
             Serial.print("Sample timeout: ");                                         
             Serial.println(Ichan);                               
+            Ichannel->cycleFailures++;
             return 2;                                                   // Return a failure
           }
                               
@@ -336,16 +413,24 @@ void samplePower(int channel, int overSample){
           startMs = millis();                            // Reset the cycle clock 
           crossCount++;                                  // Count the crossings 
           crossGuard = 10;                               // No more crosses for awhile
+          interval = (uint32_t)(cycleNow - cycleThen);   // Interpolate the crossing between the two V samples
+          if(interval > 0x7FFFF) interval = 0x7FFFF;
+          crossAt = cycleThen + interval * abs(lastV) / (abs(lastV) + abs(rawV));
+          if(rawV >= 0 && ! rising){
+            risingCross = crossAt;
+            rising = true;
+          }
           if(crossCount == 1){
             trace(T_SAMP,4);
-            firstCrossUs = micros();
+            firstCross = crossAt;
             samples++;   
             VsamplePtr++;                                 // Accumulate samples
             IsamplePtr++;  
+            TsamplePtr++;
           }
           else if(crossCount == crossLimit) {
             trace(T_SAMP,6);
-            lastCrossUs = micros();                     // To compute frequency
+            lastCross = crossAt;                        // To compute frequency
             lastCrossMs = millis();                     // For main loop dispatcher to estimate when next crossing is imminent
             lastCrossSamples = samples;
             crossGuard = overSamples + 1;
@@ -358,20 +443,33 @@ void samplePower(int channel, int overSample){
 
   *VsamplePtr = rawV;                                       
   *IsamplePtr = (rawI + lastI) >> 1;
+  interval = (uint32_t)(cycleNow - cycleThen) >> 4;
+  *TsamplePtr = interval > 0xFFFF ? 0xFFFF : interval;
    
   trace(T_SAMP,8);
 
-  if(samples < ((lastCrossUs - firstCrossUs) * 10 / 264)){
-    Serial.print("Low sample count ");
-    Serial.println(samples);
-    return 1;
+          // Check the sample intervals.  If the largest is more than twice the average,
+          // sampling was interrupted and the samples need to be time weighted.
+          // If it is more than 10 degrees of the cycle, there's too much missing to
+          // interpolate across, so reject the cycle.
+
+  uint32_t cycleTicks = (uint32_t)(lastCross - firstCross) / 16;
+  samplesIrregular = maxInterval > (2 * cycleTicks / samples);
+  if(samplesIrregular){
+    if(maxInterval > (cycleTicks / (36 * cycles))){
+      Serial.print("Sample gap ");
+      Serial.println(maxInterval * 16 / ESP.getCpuFreqMHz());
+      rejectedCycles++;
+      Ichannel->cycleFailures++;
+      return 1;
+    }
+    irregularCycles++;
   }
   
-          // Update damped frequency.
+          // Update frequency.
 
-  float Hz = 1000000.0  / float((uint32_t)(lastCrossUs - firstCrossUs));
-  Vchannel->setHz(Hz);
-  frequency = (0.9 * frequency) + (0.1 * Hz);
+  measureFrequency(Vchannel, risingCross, ESP.getCpuFreqMHz() * 1000000.0 * cycles / (uint32_t)(lastCross - firstCross));
+  if(Vchannel->dataBucket.Hz > 0) frequency = Vchannel->dataBucket.Hz;
 
           // Note the sample rate.
           // This is just a snapshot from single cycle sampling.
@@ -380,10 +478,60 @@ void samplePower(int channel, int overSample){
 
   samplesPerCycle = samplesPerCycle * .9 + (samples / cycles) * .1;
   cycleSamples++;
+  Ichannel->cycleCount++;
   
   return 0;
 }
 
+/****************************************************************************************************
+ * measureFrequency() - Frequency from the time between crossings far apart.
+ * 
+ * Timing a single cycle, even from cycle counter timestamps interpolated between samples, is only
+ * good to a few hundred ppm because of noise on the samples near the crossing.  But the error is
+ * the same however far apart the two crossings are, so each VT's first rising crossing is kept
+ * and, once a second or more has gone by, the frequency is the whole number of cycles since then
+ * over the time.  That's good to a few ppm (mHz), and costs nothing more per cycle.  The number
+ * of cycles comes from the last measurement.  If that doesn't come out close to a whole number
+ * (the frequency has jumped), the single cycle is used to get back in step.
+ * 
+ * Each measurement goes to the channel (setHz), which keeps the Hz-hours that dataLog records
+ * and the lowest and highest since the last log record.
+ ****************************************************************************************************/
+
+#define FREQ_BASELINE_MS 1000               // Shortest time between the crossings timed
+#define FREQ_BASELINE_MAX_MS 10000          // Longest, well within the cycle counter's wrap at 160MHz
+
+static void measureFrequency(IotaInputChannel* Vchannel, uint32_t crossCycles, float cycleHz){
+  static uint32_t anchorCycles [MAXINPUTS];
+  static uint32_t anchorMs [MAXINPUTS];     // Zero for none
+  int Vchan = Vchannel->_channel;
+  uint32_t timeNow = millis();
+  uint32_t elapsedMs = timeNow - anchorMs[Vchan];
+  if(anchorMs[Vchan] && elapsedMs < FREQ_BASELINE_MS){
+    return;
+  }
+  float lastHz = Vchannel->dataBucket.Hz;
+  boolean fresh = anchorMs[Vchan] && elapsedMs <= FREQ_BASELINE_MAX_MS;
+  uint32_t ticks = crossCycles - anchorCycles[Vchan];
+  anchorCycles[Vchan] = crossCycles;
+  anchorMs[Vchan] = timeNow | 1;
+  if( ! fresh){
+    if(lastHz == 0) Vchannel->setHz(cycleHz);
+    return;
+  }
+  double cpuHz = ESP.getCpuFreqMHz() * 1000000.0;
+  double cycles = ticks * double(lastHz > 0 ? lastHz : cycleHz) / cpuHz;
+  uint32_t whole = cycles + 0.5;
+  if(whole && abs(cycles - whole) < 0.2){
+    float Hz = whole * cpuHz / ticks;
+    if(abs(Hz - cycleHz) < cycleHz / 100){
+      Vchannel->setHz(Hz);
+      return;
+    }
+  }
+  Vchannel->setHz(cycleHz);
+}
+
 //**********************************************************************************************
 //
 //        readADC(uint8_t channel)
@@ -409,20 +557,32 @@ int readADC(uint8_t channel){
  * sampleVoltage() is used to sample just voltage and is also used by the voltage calibration handler.
  * It uses sampleCycle specifying the voltage channel for both channel parameters thus 
  * doubling the number of voltage samples.
- * It returns the voltage corresponding to the supplied calibration factor
+ * It returns the voltage corresponding to the supplied calibration factor, or zero if sampling
+ * failed, with *noSignal (if given) set when that's because there's no voltage signal at all.
  ****************************************************************************************************/
-float sampleVoltage(uint8_t Vchan, float Vcal){
+float sampleVoltage(uint8_t Vchan, float Vcal, bool* noSignal){
   IotaInputChannel* Vchannel = inputChannel[Vchan];
   uint32_t sumVsq = 0;
+  int32_t sumW = 0;
+  int64_t sumVsqW = 0;
   while(int rtc = sampleCycle(Vchannel, Vchannel, 1, 0)){
-    if(rtc == 2){
+    if(rtc >= 2){
       Serial.println("Zero sample voltage");
+      if(noSignal) *noSignal = rtc == 3;
       return 0.0;
     }
   }
   for(int i=0; i<samples; i++){  
     sumVsq += Vsample[i] * Vsample[i];
     sumVsq += Isample[i] * Isample[i];
+    if(samplesIrregular){
+      int32_t w = Tsample[i] + Tsample[i+1];
+      sumW += w;
+      sumVsqW += (int64_t)(Vsample[i] * Vsample[i] + Isample[i] * Isample[i]) * w;
+    }
+  }
+  if(samplesIrregular && sumW > 0){
+    sumVsq = sumVsqW * samples / sumW;
   }
   double Vratio = Vcal * Vadj_3 * getAref(Vchan) / double(ADC_RANGE);
   return  Vratio * sqrt((double)(sumVsq / (samples * 2)));
@@ -513,3 +673,124 @@ float samplePhase(uint8_t Vchan, uint8_t Ichan, uint16_t Ishift){
 }
 
 
+
+
+/****************************************************************************************************
+ * ADC bias persistence.
+ * 
+ * Each channel's _offset (ADC bias) starts at midrange and is trimmed by samplePower each time 
+ * the channel is sampled.  With fifteen channels round-robined, it takes a while to settle after
+ * a restart.  biasService checkpoints the learned offsets, along with the Aref of each channel,
+ * to RTC user memory (survives soft resets) every minute and to the SD every hour.  
+ * 
+ * restoreBias() is called in Setup after the config is processed.  It takes the RTC copy if valid,
+ * otherwise the SD copy.  A checkpoint is only used if it has the right checksum and number of 
+ * channels, every offset is in the legal range, and every Aref is within 1% of what it reads now.
+ * 
+ * The image is the same in both places:
+ *    [0] magic  [1] channel count  [2] checksum  [3+n] (Aref millivolts << 16) | offset
+ ****************************************************************************************************/
+
+#define RTC_BIAS 64                         // Word offset of checkpoint in RTC_USER_MEM (trace uses 96-127)
+#define BIAS_MAGIC 0x42494153               // "BIAS"
+#define BIAS_WORDS (3 + MAXINPUTS)
+
+static uint32_t biasChecksum(uint32_t* image){
+  uint32_t sum = BIAS_MAGIC;
+  for(int i=3; i<(3 + image[1]); i++){
+    sum = ((sum << 1) | (sum >> 31)) ^ image[i];
+  }
+  return sum;
+}
+
+static void buildBiasImage(uint32_t* image){
+  image[0] = BIAS_MAGIC;
+  image[1] = maxInputs;
+  for(int i=0; i<maxInputs; i++){
+    uint32_t arefMv = getAref(i) * 1000.0 + 0.5;
+    image[3+i] = (arefMv << 16) | inputChannel[i]->_offset;
+  }
+  image[2] = biasChecksum(image);
+}
+
+static bool validBiasImage(uint32_t* image){
+  const uint16_t minOffset = ADC_RANGE / 2 - ADC_RANGE / 200;
+  const uint16_t maxOffset = ADC_RANGE / 2 + ADC_RANGE / 200;
+  if(image[0] != BIAS_MAGIC || image[1] != maxInputs || image[2] != biasChecksum(image)){
+    return false;
+  }
+  for(int i=0; i<maxInputs; i++){
+    uint16_t offset = image[3+i] & 0xFFFF;
+    int32_t arefMv = image[3+i] >> 16;
+    int32_t arefNow = getAref(i) * 1000.0 + 0.5;
+    if(offset < minOffset || offset > maxOffset) return false;
+    if(abs(arefNow - arefMv) > (arefMv / 100 + 1)) return false;
+  }
+  return true;
+}
+
+bool restoreBias(){
+  uint32_t image[BIAS_WORDS];
+  String source = "RTC";
+  for(int i=0; i<BIAS_WORDS; i++){
+    image[i] = READ_PERI_REG(RTC_USER_MEM + RTC_BIAS + i);
+  }
+  if( ! validBiasImage(image)){
+    source = "SD";
+    File biasIn = SD.open(biasFile, FILE_READ);
+    if( ! biasIn){
+      return false;
+    }
+    int len = biasIn.read((uint8_t*)image, sizeof(image));
+    biasIn.close();
+    if(len != sizeof(image) || ! validBiasImage(image)){
+      msgLog(F("ADC bias checkpoint invalid, starting at midrange."));
+      return false;
+    }
+  }
+  for(int i=0; i<maxInputs; i++){
+    inputChannel[i]->_offset = image[3+i] & 0xFFFF;
+  }
+  msgLog("ADC bias restored from ", source);
+  return true;
+}
+
+/****************************************************************************************************
+ * biasService - checkpoint ADC bias as described above, and log how long it took to settle.
+ ****************************************************************************************************/
+
+uint32_t biasService(struct serviceBlock* _serviceBlock){
+  static uint32_t checkpoints = 0;
+  static boolean settled = false;
+  uint32_t image[BIAS_WORDS];
+
+  if( ! settled){
+    uint32_t needed = 0;
+    for(int i=0; i<maxInputs; i++){
+      if(inputChannel[i]->isActive() && inputChannel[i]->_type == channelTypePower){
+        needed |= (1 << i) | (1 << inputChannel[i]->_vchannel);
+      }
+    }
+    if((biasSettled & needed) == needed){
+      settled = true;
+      msgLog("ADC bias settled, ms after restart: ", millis());
+    }
+    else {
+      return UNIXtime() + 1;
+    }
+  }
+  
+  buildBiasImage(image);
+  for(int i=0; i<BIAS_WORDS; i++){
+    WRITE_PERI_REG(RTC_USER_MEM + RTC_BIAS + i, image[i]);
+  }
+  if((checkpoints++ % 60) == 0){
+    File biasOut = SD.open(biasFile, FILE_WRITE);
+    if(biasOut){
+      biasOut.seek(0);
+      biasOut.write((uint8_t*)image, sizeof(image));
+      biasOut.close();
+    }
+  }
+  return UNIXtime() + 60;
+}
@@ -5,8 +5,9 @@ void    samplePower(int channel, int overSample);
 int     sampleCycle(IotaInputChannel* Vchannel, IotaInputChannel* Ichannel, int cycles, int overSamples);
 float   getAref(int channel);
 int     readADC(uint8_t channel);
-float   sampleVoltage(uint8_t Vchan, float Vcal);
+float   sampleVoltage(uint8_t Vchan, float Vcal, bool* noSignal = nullptr);
 float   samplePhase(uint8_t Vchan, uint8_t Ichan, uint16_t Ishift);
 void    printSamples();
+bool    restoreBias();
 
 #endif
\ No newline at end of file
@@ -67,7 +67,7 @@ uint32_t UNIXtime() {
  }
  
 uint32_t MillisAtUNIXtime(uint32_t UnixTime){                  
-  return (uint32_t)timeRefMs + 1000 * (UnixTime - SEVENTY_YEAR_SECONDS - timeRefNTP);
+  return (uint32_t)timeRefMs + 1000 * (UnixTime + SEVENTY_YEAR_SECONDS - timeRefNTP);
  }
 
 /********************************************************************************************
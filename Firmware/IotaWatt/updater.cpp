@@ -8,6 +8,9 @@ size_t httpRead(uint8_t* buff, size_t len);
  * 
  *************************************************************************************************/
 uint32_t updater(struct serviceBlock* _serviceBlock) {
+  if( ! wifiConnected){
+    return UNIXtime() + 5;                        // Check as soon as the network is up
+  }
   if(checkUpdate()){
     msgLog ("Firmware updated, restarting.");
     delay(500);
@@ -0,0 +1,61 @@
+#include "IotaWatt.h"
+
+/***************************************************************************************************
+ *  Uploader HTTP(S) connections.
+ *
+ *  Plain HTTP posts use the shared HTTPClient and a new connection each time, as they always have.
+ *  An https:// server gets a client of its own that keeps the connection open between posts
+ *  (keep-alive), so the TLS handshake - seconds of CPU on the ESP8266, with sampling stopped - is
+ *  only done when the server has dropped the connection.  The server's certificate is checked
+ *  against the SHA1 fingerprint from the config ("fingerprint"), so there's no certificate chain
+ *  to carry or verify.  Without a fingerprint nothing is posted to an https:// server.
+ *
+ *  The time each post takes, and how many needed a new connection, show in /status?stats.
+ **************************************************************************************************/
+
+static HTTPClient secureHttp;
+static String lastFailure;
+
+static HTTPClient* uploadFailed(const String& reason);
+
+/***************************************************************************************************
+ *  uploadBegin() - Get a client ready to make a request, nullptr if it can't be made.
+ *  uploadEnd() - Finish with it, and count the time since startMs.
+ **************************************************************************************************/
+HTTPClient* uploadBegin(const String& host, uint16_t port, const String& uri, bool https){
+  if( ! https){
+    if( ! http.begin(host, port, uri)) return uploadFailed("upload: request to " + host + " not started, not posted.");
+    lastFailure = "";
+    return &http;
+  }
+  if(uploadFingerprint.length() == 0){
+    return uploadFailed("upload: https needs the server's certificate fingerprint, not posted to " + host);
+  }
+  if( ! secureHttp.connected()){
+    uploadConnects++;
+  }
+  secureHttp.setReuse(true);
+  if( ! secureHttp.begin(host, port, uri, uploadFingerprint)){
+    return uploadFailed("upload: https request to " + host + " not started, check the fingerprint. Not posted.");
+  }
+  lastFailure = "";
+  return &secureHttp;
+}
+
+void uploadEnd(HTTPClient& client, uint32_t startMs){
+  client.end();
+  uploadLastMs = millis() - startMs;
+  if(uploadLastMs > uploadMaxMs) uploadMaxMs = uploadLastMs;
+  uploadTotalMs += uploadLastMs;
+  uploadPosts++;
+}
+
+        // Say why once, not on every retry.
+
+static HTTPClient* uploadFailed(const String& reason){
+  if( ! reason.equals(lastFailure)){
+    msgLog(reason);
+    lastFailure = reason;
+  }
+  return nullptr;
+}
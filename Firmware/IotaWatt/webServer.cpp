@@ -247,6 +247,11 @@ void handleNotFound(){
     handleGetFeedList();
     return;
   }
+  if(serverURI.startsWith("/feed/minmax")){
+    serverAvailable = false;
+    NewService(handleGetFeedMinMax);
+    return;
+  }
   if(serverURI == "/graph/getall"){
     handleGraphGetall();
     return;
@@ -257,6 +262,10 @@ void handleNotFound(){
     return;
   }
   if(loadFromSdCard(server.uri())) return;
+  if(wifiPortalRequest()){
+    handleWiFiRedirect();
+    return;
+  }
   String message = "Not found: ";
   message += (server.method() == HTTP_GET)?"GET":"POST";
   message += ", URI: ";
@@ -275,6 +284,7 @@ void handleStatus(){
   trace(T_WEB,0); 
   DynamicJsonBuffer jsonBuffer;
   JsonObject& root = jsonBuffer.createObject(); 
+  statDemand();
   
   if(server.hasArg("stats")){
     trace(T_WEB,14);
@@ -285,8 +295,39 @@ void handleStatus(){
     stats.set("stack",ESP.getFreeHeap());
     stats.set("version",IOTAWATT_VERSION);
     stats.set("frequency",frequency);
+    stats.set("irregular",irregularCycles);
+    stats.set("rejected",rejectedCycles);
+    stats.set("statms",statServiceMs);
+    if(uploadPosts){
+      stats.set("uploadposts",uploadPosts);
+      stats.set("uploadconnects",uploadConnects);
+      stats.set("uploadms",uploadLastMs);
+      stats.set("uploadmaxms",uploadMaxMs);
+      stats.set("uploadavgms",uploadTotalMs / uploadPosts);
+    }
+    if(realtimeOutputs) realtimeStatus(stats);
     root.set("stats",stats);
   }
+
+  if(server.hasArg("admission")){
+    JsonObject& admission = jsonBuffer.createObject();
+    admissionStatus(admission);
+    root.set("admission",admission);
+  }
+
+  if(server.hasArg("datalog")){
+    JsonObject& datalog = jsonBuffer.createObject();
+    datalog.set("state", dataLogDegraded ? "degraded" : "ok");
+    datalog.set("lastkey", iotaLog.lastKey());
+    datalog.set("flash", flashJournalEntries());
+    if(dataLogDegraded){
+      datalog.set("since", dataLogDegradedSince);
+      datalog.set("journal", journalEntries());
+      datalog.set("capacity", journalCapacity());
+      datalog.set("stride", journalStride());
+    }
+    root.set("datalog",datalog);
+  }
   
   if(server.hasArg("inputs")){
     trace(T_WEB,15);
@@ -320,16 +361,18 @@ void handleStatus(){
     trace(T_WEB,16);
     JsonArray& outputArray = jsonBuffer.createArray();
     Script* script = outputs->first();
+    outputs->memoBegin();
     while(script){
       JsonObject& channelObject = jsonBuffer.createObject();
       channelObject.set("name",script->name());
       channelObject.set("units",script->units());
-      double value = script->run([](int i)->double {return statBucket[i].value1;});
+      double value = script->run(statInput);
       channelObject.set("value",value);
       channelObject.set("Watts",value);  // depricated 3.04
       outputArray.add(channelObject);
       script = script->next();
     }
+    outputs->memoEnd();
     root["outputs"] = outputArray;
   }
 
@@ -340,7 +383,7 @@ void handleStatus(){
   }
   String response = "";
   root.printTo(response);
-  server.send(200, "text/json", response);  
+  sendResponse(200, "text/json", response);  
 }
 
 void handleVcal(){
@@ -394,6 +437,15 @@ void handleCommand(){
     server.send(200, "text/plain", response);
     return; 
   }
+  if(server.hasArg("rebuildoutputs")) {
+    trace(T_WEB,24);
+    if( ! outputRebuilding){
+      outputRebuilding = true;
+      NewService(outputRebuildService);
+    }
+    server.send(200, "text/plain", "ok");
+    return;
+  }
   if(server.hasArg("disconnect")) {
     trace(T_WEB,6); 
     server.send(200, "text/plain", "ok");
@@ -429,7 +481,29 @@ void handleGetFeedList(){
         energy["tag"] = "Energy";
         energy["name"] = inputChannel[i]->_name;
         array.add(energy);
+        if(inputChannel[i]->_signed){
+          JsonObject& imported = jsonBuffer.createObject();
+          imported["id"] = String(inputChannel[i]->_channel*10+QUERY_IMPORT);
+          imported["tag"] = "Energy";
+          imported["name"] = inputChannel[i]->_name + " import";
+          array.add(imported);
+          JsonObject& exported = jsonBuffer.createObject();
+          exported["id"] = String(inputChannel[i]->_channel*10+QUERY_EXPORT);
+          exported["tag"] = "Energy";
+          exported["name"] = inputChannel[i]->_name + " export";
+          array.add(exported);
+        }
       }
+      JsonObject& cycles = jsonBuffer.createObject();
+      cycles["id"] = String(inputChannel[i]->_channel*10+QUERY_CYCLES);
+      cycles["tag"] = "Quality";
+      cycles["name"] = inputChannel[i]->_name + " cycles";
+      array.add(cycles);
+      JsonObject& failures = jsonBuffer.createObject();
+      failures["id"] = String(inputChannel[i]->_channel*10+QUERY_FAILURES);
+      failures["tag"] = "Quality";
+      failures["name"] = inputChannel[i]->_name + " failures";
+      array.add(failures);
     }
   }
   trace(T_WEB,19);
@@ -456,6 +530,54 @@ void handleGetFeedList(){
   server.send(200, "application/json", response);
 }
 
+/************************************************************************************************
+ *  GET /feed/minmax?id=<feed id>&start=<UNIXtime>&end=<UNIXtime>
+ *  Lowest and highest average value of an input over the log intervals in the range.
+ *  Uses the log's summary blocks, so a month costs about the same as a day.  While the summary
+ *  is catching up, a range it doesn't cover yet gets 503 rather than reading the whole log here.
+ *  The partial blocks at either end can still be a lot of records, so this is a SERVICE, like
+ *  GetFeedData, reading MINMAX_READS at a time.
+ ***********************************************************************************************/
+uint32_t handleGetFeedMinMax(struct serviceBlock* _serviceBlock){
+  trace(T_WEB,23);
+  static boolean started = false;
+  static int channel;
+  static uint32_t startUnixTime;
+  static uint32_t endUnixTime;
+  static double min, max;
+  if( ! started){
+    channel = server.arg("id").toInt() / 10;
+    startUnixTime = server.arg("start").substring(0,10).toInt();
+    endUnixTime = server.arg("end").substring(0,10).toInt();
+    if(channel >= maxInputs || endUnixTime < startUnixTime){
+      server.send(400, "text/plain", "Invalid request");
+      serverAvailable = true;
+      return 0;
+    }
+    min = FLT_MAX;
+    max = -FLT_MAX;
+    started = true;
+    _serviceBlock->priority = priorityLow;
+  }
+  int rtc = iotaLog.minMax(&startUnixTime, endUnixTime, channel, &min, &max, MINMAX_READS);
+  if(rtc == 3){
+    return 1;
+  }
+  started = false;
+  serverAvailable = true;
+  if(rtc == 2){
+    server.sendHeader("Retry-After", "60");
+    server.send(503, "text/plain", "Log summary not ready");
+    return 0;
+  }
+  String response = "{\"min\":null,\"max\":null}";
+  if(rtc == 0){
+    response = "{\"min\":" + String(min,1) + ",\"max\":" + String(max,1) + "}";
+  }
+  server.send(200, "application/json", response);
+  return 0;
+}
+
 void handleGraphGetall(){                   // Stub to appease EmonCMS graph app
   return;
   server.send(200, "ok", "{}");
@@ -499,3 +621,56 @@ void handleGetConfig(){
   server.send(400, "text/plain", "Bad Request.");
 }
 
+
+/************************************************************************************************
+ *  Compressed responses.
+ *
+ *  Clients that say they take gzip (Accept-Encoding) get the bigger responses compressed with
+ *  GzipStream.  Below GZIP_MIN_RESPONSE it isn't worth the CPU.  sendResponse() does it for a
+ *  response in a String, if the heap can hold the compressed copy and the GzipStream with
+ *  GZIP_HEAP_RESERVE to spare (otherwise it's sent as is).  /feed/data compresses as it goes and
+ *  sends through sendChunked().
+ ***********************************************************************************************/
+bool acceptsGzip(){
+  return server.header("Accept-Encoding").indexOf("gzip") >= 0;
+}
+
+static uint8_t* gzipBuf = nullptr;
+static size_t gzipSize = 0;
+static size_t gzipLen = 0;
+
+void sendResponse(int code, const char* contentType, const String& content){
+  gzipSize = content.length() + content.length() / 8 + 64;
+  if(content.length() < GZIP_MIN_RESPONSE || ! acceptsGzip() ||
+     ESP.getFreeHeap() < gzipSize + GZIP_HEAP + GZIP_HEAP_RESERVE){
+    server.send(code, contentType, content);
+    return;
+  }
+  gzipBuf = new uint8_t [gzipSize];
+  gzipLen = 0;
+  GzipStream* gzip = new GzipStream([](const uint8_t* data, size_t length){
+    if(gzipLen + length <= gzipSize) memcpy(gzipBuf + gzipLen, data, length);
+    gzipLen += length;
+  });
+  gzip->write(content);
+  gzip->finish();
+  delete gzip;
+  if(gzipLen > gzipSize){
+    server.send(code, contentType, content);
+  }
+  else {
+    server.sendHeader("Content-Encoding", "gzip");
+    server.setContentLength(gzipLen);
+    server.send(code, contentType, "");
+    server.client().write((const char*)gzipBuf, gzipLen);
+  }
+  delete[] gzipBuf;
+  gzipBuf = nullptr;
+}
+
+void sendChunked(const uint8_t* data, size_t length){
+  String header = String(length, HEX) + "\r\n";
+  server.client().write(header.c_str(), header.length());
+  server.client().write((const char*)data, length);
+  server.client().write("\r\n", 2);
+}
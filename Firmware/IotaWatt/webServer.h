@@ -1,6 +1,10 @@
 #ifndef webServer_h
 #define webServer_h
 
+#define GZIP_MIN_RESPONSE 1024          // Smaller responses aren't worth compressing
+#define GZIP_HEAP_RESERVE 2048          // Heap to leave free when compressing a response
+#define MINMAX_READS 32                 // Summary blocks and log records /feed/minmax reads per turn
+
 void returnOK();
 void returnFail(String msg);
 bool loadFromSdCard(String path);
@@ -14,8 +18,19 @@ void handleStatus();
 void handleVcal();
 void handleCommand();
 void handleGetFeedList();
+uint32_t handleGetFeedMinMax(struct serviceBlock*);
 void handleGraphGetall();
 void sendMsgFile(File &dataFile, int32_t relPos);
+bool acceptsGzip();
+void sendResponse(int code, const char* contentType, const String& content);
+void sendChunked(const uint8_t* data, size_t length);
 void handleGetConfig();
+void handleWiFiPortal();
+void handleWiFiSave();
+void handleWiFiRedirect();
+void handlePQEvents();
+void handleCaptureList();
+void handleCaptureData();
+void handleLoadEvents();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,37 @@
+#!/usr/bin/env python3
+"""Print the readings an IotaWatt multicasts (see Firmware/IotaWatt/multicast.cpp).
+
+    multicastReceive.py [group] [port]      defaults 239.255.73.1 7377
+"""
+import socket
+import struct
+import sys
+
+group = sys.argv[1] if len(sys.argv) > 1 else "239.255.73.1"
+port = int(sys.argv[2]) if len(sys.argv) > 2 else 7377
+
+sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+sock.bind(("", port))
+sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP,
+                struct.pack("4s4s", socket.inet_aton(group), socket.inet_aton("0.0.0.0")))
+
+while True:
+    data, (address, _) = sock.recvfrom(2048)
+    if len(data) < 20 or data[0:4] != b"IOTA" or data[4] != 1:
+        continue
+    channels, outputs, flags = data[5], data[6], data[7]
+    sequence, unixtime, periodMs = struct.unpack_from("<III", data, 8)
+    print("%s seq %d time %d period %dms%s" % (address, sequence, unixtime, periodMs,
+                                               " (log degraded)" if flags & 1 else ""))
+    offset = 20
+    for channel in range(channels):
+        kind, vchannel, _, a, b = struct.unpack_from("<BBHff", data, offset)
+        offset += 12
+        if kind == 1:
+            print("  %2d  %8.2f V   %6.2f Hz" % (channel, a, b))
+        elif kind == 2:
+            print("  %2d  %8.1f W   %6.2f A   (VT %d)" % (channel, a, b, vchannel))
+    for output in range(outputs):
+        print("  output %d  %.2f" % (output, struct.unpack_from("<f", data, offset)[0]))
+        offset += 4